@@ -16,10 +16,15 @@
  */
 #define _GNU_SOURCE
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -29,15 +34,50 @@
 #include <afb/afb-binding.h>
 
 #include "curl-wrap.h"
+#include "endpoints.h"
+#include "cache.h"
+#include "pcm.h"
+#include "mempress.h"
+#include "tokens.h"
+#include "library.h"
+#include "replay.h"
+#include "trace.h"
+#include "watchdog.h"
 
+static const char default_config[] = "/usr/libexec/spotify/config.json";
+static const char default_endpoint[] = "https://agl-graphapi.forgerocklabs.org";
+static const char default_cache[] = "/home/root/.cache/librespot";
+static const char default_player[] = "/usr/libexec/spotify/playspot";
+static const char default_webapi[] = "https://api.spotify.com/v1";
+
+static struct json_object *config;
+static char *player_path;
 static char *user;
 static char *reftok;
-static char *bearer;
-static int expire;
-static time_t endat;
-static char endpoint[] = "https://agl-graphapi.forgerocklabs.org";
 static pid_t pid;
 
+/* debouncing of the login/logout events */
+static pthread_mutex_t evmutex = PTHREAD_MUTEX_INITIALIZER;
+static int debounce;		/* debouncing window in ms */
+static int evpending;		/* is a transition job queued? */
+static int evlogin;		/* last state requested: login or logout */
+static long evlast;		/* time in ms of the last event */
+static long evfirst;		/* time in ms of the first event of a burst */
+static struct {
+	unsigned received;	/* count of login/logout events received */
+	unsigned collapsed;	/* count of events collapsed in a pending one */
+	unsigned ignored;	/* count of transitions to the current state */
+	unsigned executed;	/* count of transitions executed */
+} evstats;
+
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void objsetstr(struct json_object *obj, const char *name, char **value, const char *def)
 {
         struct json_object *v;
@@ -60,6 +100,191 @@ static void objsetint(struct json_object *obj, const char *name, int *value, int
 		  && json_object_get_type(v) == json_type_int) ? json_object_get_int(v) : def;
 }
 
+/* emits the traces through the daemon */
+static void emit(int level, const char *func, int line, const char *message)
+{
+	switch (level) {
+	case 0: case 1: case 2: case 3:
+		AFB_ERROR("%s:%d: %s", func, line, message);
+		break;
+	case 4:
+		AFB_WARNING("%s:%d: %s", func, line, message);
+		break;
+	case 5:
+		AFB_NOTICE("%s:%d: %s", func, line, message);
+		break;
+	case 6:
+		AFB_INFO("%s:%d: %s", func, line, message);
+		break;
+	default:
+		AFB_DEBUG("%s:%d: %s", func, line, message);
+		break;
+	}
+}
+
+/*
+ * Reacts to the stages of the memory pressure, from the cheapest lever.
+ * It is best effort: the player keeps its own buffers.
+ */
+static void on_memory_stage(int stage)
+{
+	TRACE_NOTICE("memory pressure stage %d", stage);
+	cache_warm_suspend(stage >= 1);
+	pcm_shrink(stage >= 2);
+	mempress_tighten(stage >= 3);
+}
+
+static void do_stop();
+static void do_start();
+
+/* job restarting the player 'arg' if it is still the current one */
+static void restart_job(int signum, void *arg)
+{
+	if (!signum && pid && pid == (pid_t)(intptr_t)arg) {
+		do_stop();
+		do_start();
+	}
+}
+
+/* job stopping the player 'arg' if it is still the current one */
+static void stop_job(int signum, void *arg)
+{
+	if (!signum && pid && pid == (pid_t)(intptr_t)arg)
+		do_stop();
+}
+
+/* the watchdog found the player 'p' hung or died */
+static void on_player_failed(int p, int restart)
+{
+	/* serialized with the transitions */
+	afb_daemon_queue_job(restart ? restart_job : stop_job,
+				(void*)(intptr_t)p, &evmutex, 0);
+}
+
+static void get_config()
+{
+	const char *path;
+	struct json_object *eps;
+	const char *url;
+	char *cachedir, *libdir, *webapi, *sink, *cgroup, *record, *url2;
+	int percentile, delay, added, quota, warmsize, pcmbuf, high, max, stall;
+	int ntokens, maxsize, scale, level, rate, deadline, replaying;
+	size_t i, n;
+
+	path = getenv("SPOTIFY_CONFIG") ?: default_config;
+	config = json_object_from_file(path);
+	objsetint(config, "log-level", &level, 5);
+	objsetint(config, "log-rate", &rate, 10);
+	trace_init(level, rate, emit);
+	if (!config)
+		TRACE_NOTICE("no configuration read from %s", path);
+
+	/* record or replay the HTTP transfers */
+	record = NULL;
+	objsetstr(config, "record", &record, NULL);
+	if (record) {
+		if (replay_record(record) < 0)
+			TRACE_ERROR("can't record in %s", record);
+		free(record);
+	}
+	record = NULL;
+	replaying = 0;
+	objsetstr(config, "replay", &record, NULL);
+	objsetint(config, "replay-scale", &scale, 100);
+	if (record) {
+		replaying = replay_serve(record, scale) >= 0;
+		if (!replaying)
+			TRACE_ERROR("can't replay %s", record);
+		free(record);
+	}
+
+	added = 0;
+	if (config && json_object_object_get_ex(config, "endpoints", &eps)
+	 && json_object_is_type(eps, json_type_array)) {
+		n = json_object_array_length(eps);
+		/*
+		 * the endpoints are all replayed by the same server where
+		 * the hedged requests would consume the recorded responses
+		 */
+		for (i = 0 ; i < n && !(replaying && added) ; i++) {
+			url = json_object_get_string(json_object_array_get_idx(eps, i));
+			url2 = url ? replay_url(url) : NULL;
+			if (url2 && endpoints_add(url2))
+				added++;
+			else
+				TRACE_ERROR("can't add endpoint %s", url);
+			free(url2);
+		}
+	}
+	if (!added && (url2 = replay_url(default_endpoint))) {
+		endpoints_add(url2);
+		free(url2);
+	}
+
+	objsetint(config, "hedge-percentile", &percentile, 95);
+	objsetint(config, "hedge-delay", &delay, 500);
+	endpoints_set_hedging(percentile, delay);
+
+	objsetint(config, "http-max-size", &maxsize, 16);
+	if (maxsize <= 0 || (size_t)maxsize > SIZE_MAX >> 20) {
+		TRACE_ERROR("invalid http-max-size %d, using 16", maxsize);
+		maxsize = 16;
+	}
+	curl_wrap_set_max_size((size_t)maxsize << 20);
+
+	objsetint(config, "token-cache", &ntokens, 8);
+	if (tokens_init(ntokens) < 0)
+		TRACE_ERROR("can't create the cache of tokens");
+
+	objsetint(config, "debounce", &debounce, 500);
+
+	cachedir = NULL;
+	objsetstr(config, "cache-dir", &cachedir, default_cache);
+	objsetint(config, "cache-quota", &quota, 1024);
+	objsetint(config, "cache-warm", &warmsize, 64);
+	if (cachedir) {
+		setenv("SPOTIFY_CACHE", cachedir, 1);
+		if (cache_init(cachedir, (unsigned long long)quota << 20,
+				(unsigned long long)warmsize << 20) < 0)
+			TRACE_ERROR("can't manage the cache %s", cachedir);
+	}
+
+	libdir = webapi = NULL;
+	objsetstr(config, "library-dir", &libdir, cachedir);
+	objsetstr(config, "web-api", &webapi, default_webapi);
+	if (webapi && (url2 = replay_url(webapi))) {
+		free(webapi);
+		webapi = url2;
+	}
+	if (libdir && webapi && library_init(libdir, webapi) < 0)
+		TRACE_ERROR("can't create the library");
+	free(libdir);
+	free(webapi);
+	free(cachedir);
+
+	objsetstr(config, "player", &player_path, default_player);
+	objsetint(config, "player-deadline", &deadline, 30);
+	watchdog_init((long)deadline * 1000, on_player_failed);
+	sink = NULL;
+	objsetstr(config, "pcm-sink", &sink, NULL);
+	objsetint(config, "pcm-buffer", &pcmbuf, 0);
+	if (sink) {
+		if (pcm_init(sink, pcmbuf) < 0)
+			TRACE_ERROR("can't route PCM to %s", sink);
+		free(sink);
+	}
+
+	cgroup = NULL;
+	objsetstr(config, "cgroup", &cgroup, NULL);
+	objsetint(config, "memory-high", &high, 0);
+	objsetint(config, "memory-max", &max, 0);
+	objsetint(config, "psi-stall", &stall, 150);
+	if (mempress_init(cgroup, (long long)high << 20, (long long)max << 20,
+				stall, on_memory_stage) < 0)
+		TRACE_ERROR("can't fully manage the memory of the player");
+	free(cgroup);
+}
+
 static void get_data()
 {
 	int rc;
@@ -84,32 +309,8 @@ static void get_data()
 
 static void do_refresh()
 {
-	int rc;
-	char *url;
-	CURL *curl;
-	struct json_object *data;
-	char *result;
-
-	if (endat && endat > time(NULL))
-		return;
-
-	rc = asprintf(&url, "%s/spotify/token?uid=%s", endpoint, user);
-	if (rc >= 0) {
-		curl = curl_wrap_prepare_get_url(url);
-		if (curl) {
-			rc = curl_wrap_perform (curl, &result, NULL);
-			if (rc >= 0) {
-				data = json_tokener_parse(result);
-				if (data) {
-					objsetstr(data, "access_token", &bearer, bearer);
-					objsetint(data, "expires_in", &expire, 3600);
-					json_object_put(data);
-					endat = time(NULL) + expire - (expire > 60 ? 60 : 0);
-				}
-				free(result);
-			}
-		}
-	}
+	if (user)
+		free(tokens_get(user));
 }
 
 static void do_stop()
@@ -118,8 +319,7 @@ static void do_stop()
 
 	if (p) {
 		pid = 0;
-		expire = 0;
-		endat = 0;
+		watchdog_stop();
 		r = waitpid(p, NULL, WNOHANG);
 		if (r == 0) {
 			kill(p, SIGKILL);
@@ -130,49 +330,394 @@ static void do_stop()
 
 static void do_start()
 {
+	int fd, errfd;
+
 	if (user && !pid) {
+		fd = pcm_open();
+		errfd = watchdog_open();
 		pid = fork();
 		if (!pid) {
-			execl("/bin/bash", "/bin/bash", "/usr/libexec/spotify/playspot", user, NULL);
+			mempress_enter();
+			/* the watchdog reads the standard error of the player */
+			if (errfd >= 0)
+				dup2(errfd, 2);
+			if (fd >= 0) {
+				/* the player writes its samples in the fd 3 */
+				if (fd == 3)
+					fcntl(fd, F_SETFD, 0);
+				else if (dup2(fd, 3) < 0)
+					_exit(1);
+				execl("/bin/bash", "/bin/bash", player_path, user,
+					"--backend", "pipe", "--device", "/dev/fd/3", NULL);
+				_exit(1);
+			}
+			execl("/bin/bash", "/bin/bash", player_path, user, NULL);
 			_exit(1);
 		}
+		if (pid < 0)
+			pid = 0;
+		pcm_started(pid);
+		watchdog_started(pid);
+		mempress_player(pid);
 	}
 }
 
+/* searches and synchronises the library of the active user */
+static void open_library()
+{
+	library_open(user);
+	if (user)
+		library_sync(user);
+}
+
 static void run()
 {
 	get_data();
 	do_start();
 	do_refresh();
+	open_library();
 }
 
-static void return_bearer (struct afb_req request)
+static void return_bearer (struct afb_req request, const char *uid)
 {
-	if (bearer)
+	char *bearer;
+
+	bearer = uid ? tokens_get(uid) : NULL;
+	if (bearer) {
 		afb_req_success(request, json_object_new_string(bearer), NULL);
-	else
+		free(bearer);
+	} else
 		afb_req_fail(request, "no-bearer", NULL);
 }
 
 static void token (struct afb_req request)
 {
-	do_refresh();
-	return_bearer(request);
+	return_bearer(request, afb_req_value(request, "uid") ?: user);
+}
+
+/* job of the verb player, serialized with the transitions */
+static void player_job(int signum, void *arg)
+{
+	struct afb_req *req = arg;
+	const char *v;
+
+	if (signum)
+		afb_req_fail(*req, "aborted", NULL);
+	else {
+		do_stop();
+		watchdog_reset();
+		v = afb_req_value(*req, "stop");
+		if (!v || (strcasecmp(v,"false") && strcmp(v,"0")))
+			run();
+		return_bearer(*req, user);
+	}
+	afb_req_unref(*req);
+	free(req);
 }
 
 static void player (struct afb_req request)
+{
+	struct afb_req *req;
+
+	req = malloc(sizeof *req);
+	if (!req) {
+		afb_req_fail(request, "out-of-memory", NULL);
+		return;
+	}
+	*req = request;
+	afb_req_addref(request);
+	if (afb_daemon_queue_job(player_job, req, &evmutex, 0) < 0) {
+		afb_req_fail(request, "failed", "can't queue the job");
+		afb_req_unref(request);
+		free(req);
+	}
+}
+
+static void search (struct afb_req request)
+{
+	const char *q, *l;
+	int limit;
+
+	q = afb_req_value(request, "q");
+	l = afb_req_value(request, "limit");
+	limit = l ? atoi(l) : 20;
+	if (!q)
+		afb_req_fail(request, "invalid", "missing query 'q'");
+	else
+		afb_req_success(request, library_search(q, limit > 0 ? limit : 20), NULL);
+}
+
+static void cache (struct afb_req request)
 {
 	const char *v;
 
-	do_stop();
-	v = afb_req_value(request, "stop");
-	if (!v || (strcasecmp(v,"false") && strcmp(v,"0")))
-		run();
-	return_bearer(request);
+	v = afb_req_value(request, "warm");
+	if (v && (!strcasecmp(v,"false") || !strcmp(v,"0")))
+		cache_warm_stop();
+	else if (v && cache_warm(user) < 0) {
+		afb_req_fail(request, "failed", "can't warm up the cache");
+		return;
+	}
+	afb_req_success(request, cache_stats(), NULL);
+}
+
+static struct json_object *events_stats()
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	pthread_mutex_lock(&evmutex);
+	json_object_object_add(result, "received", json_object_new_int64(evstats.received));
+	json_object_object_add(result, "collapsed", json_object_new_int64(evstats.collapsed));
+	json_object_object_add(result, "ignored", json_object_new_int64(evstats.ignored));
+	json_object_object_add(result, "executed", json_object_new_int64(evstats.executed));
+	pthread_mutex_unlock(&evmutex);
+	return result;
+}
+
+static struct json_object *http_stats()
+{
+	struct json_object *result, *array, *item;
+	struct curl_wrap_transfer last[CURL_WRAP_TRANSFERS];
+	struct curl_wrap_stats st;
+	int i, n;
+
+	curl_wrap_get_stats(&st);
+	n = curl_wrap_get_transfers(last, CURL_WRAP_TRANSFERS);
+	result = json_object_new_object();
+	json_object_object_add(result, "transfers", json_object_new_int64(st.transfers));
+	json_object_object_add(result, "encoded", json_object_new_int64(st.encoded));
+	json_object_object_add(result, "capped", json_object_new_int64(st.capped));
+	json_object_object_add(result, "wire-bytes", json_object_new_int64(st.wire));
+	json_object_object_add(result, "decoded-bytes", json_object_new_int64(st.decoded));
+	json_object_object_add(result, "time-us", json_object_new_int64(st.time_us));
+	array = json_object_new_array();
+	for (i = 0 ; i < n ; i++) {
+		item = json_object_new_object();
+		json_object_object_add(item, "url", json_object_new_string(last[i].url));
+		json_object_object_add(item, "encoding", json_object_new_string(last[i].encoding));
+		json_object_object_add(item, "ok", json_object_new_boolean(last[i].ok));
+		json_object_object_add(item, "capped", json_object_new_boolean(last[i].capped));
+		json_object_object_add(item, "wire-bytes", json_object_new_int64(last[i].wire));
+		json_object_object_add(item, "decoded-bytes", json_object_new_int64(last[i].decoded));
+		json_object_object_add(item, "time-us", json_object_new_int64(last[i].time_us));
+		json_object_array_add(array, item);
+	}
+	json_object_object_add(result, "last", array);
+	return result;
+}
+
+static void stats (struct afb_req request)
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	json_object_object_add(result, "endpoints", endpoints_stats());
+	json_object_object_add(result, "http", http_stats());
+	json_object_object_add(result, "replay", replay_stats());
+	json_object_object_add(result, "tokens", tokens_stats());
+	json_object_object_add(result, "events", events_stats());
+	json_object_object_add(result, "cache", cache_stats());
+	json_object_object_add(result, "library", library_stats());
+	json_object_object_add(result, "pcm", pcm_stats());
+	json_object_object_add(result, "memory", mempress_stats());
+	json_object_object_add(result, "player", watchdog_stats());
+	afb_req_success(request, result, NULL);
+}
+
+/*
+ * Batches of operations. The operations changing the state of the
+ * player are made one after the other and in order, then all the others
+ * are made concurrently. The reply is sent when all are terminated.
+ */
+
+/* maximum count of operations of a batch */
+#define BATCH_MAX	32
+
+struct batch;
+
+struct batchop {
+	struct batch *batch;
+	const char *verb;
+	struct json_object *args;
+	struct json_object *result;	/* the item of the reply */
+	int serial;			/* does it change the state? */
+};
+
+struct batch {
+	struct afb_req request;
+	struct json_object *parsed;	/* the operations when given as a string */
+	pthread_mutex_t mutex;
+	int pending;		/* operations not terminated, plus 1 when launching */
+	int next;		/* index of the next serial operation */
+	int count;
+	struct batchop ops[];
+};
+
+/* verbs that can't run concurrently with the others */
+static const char *const serial_verbs[] = { "player", NULL };
+
+static void batch_next(struct batch *b);
+
+static void batch_unref(struct batch *b)
+{
+	struct json_object *result;
+	int i, last;
+
+	pthread_mutex_lock(&b->mutex);
+	last = !--b->pending;
+	pthread_mutex_unlock(&b->mutex);
+	if (!last)
+		return;
+
+	result = json_object_new_array();
+	for (i = 0 ; i < b->count ; i++)
+		json_object_array_add(result, b->ops[i].result);
+	afb_req_success(b->request, result, NULL);
+	afb_req_unref(b->request);
+	json_object_put(b->parsed);
+	pthread_mutex_destroy(&b->mutex);
+	free(b);
+}
+
+/* records the item of the reply of 'op' and terminates it */
+static void batch_done(struct batchop *op, const char *status,
+		struct json_object *info, struct json_object *response)
+{
+	struct json_object *item;
+
+	item = json_object_new_object();
+	json_object_object_add(item, "verb", json_object_new_string(op->verb ?: ""));
+	json_object_object_add(item, "status", json_object_new_string(status));
+	if (info)
+		json_object_object_add(item, "info", json_object_get(info));
+	if (response)
+		json_object_object_add(item, "response", json_object_get(response));
+	op->result = item;
+	if (op->serial)
+		batch_next(op->batch);
+	batch_unref(op->batch);
+}
+
+static void batch_reply(void *closure, int iserror, struct json_object *result)
+{
+	struct json_object *request, *status, *info, *response;
+
+	status = info = response = NULL;
+	if (result) {
+		if (json_object_object_get_ex(result, "request", &request)) {
+			json_object_object_get_ex(request, "status", &status);
+			json_object_object_get_ex(request, "info", &info);
+		}
+		json_object_object_get_ex(result, "response", &response);
+	}
+	batch_done(closure,
+		status ? json_object_get_string(status) : iserror ? "failed" : "success",
+		info, response);
+}
+
+static void batch_call(struct batchop *op)
+{
+	if (!op->verb || !strcmp(op->verb, "batch"))
+		batch_done(op, "invalid", NULL, NULL);
+	else
+		afb_service_call("spotify", op->verb,
+			op->args ? json_object_get(op->args) : json_object_new_object(),
+			batch_reply, op);
+}
+
+/* launches the next serial operation or else all the concurrent ones */
+static void batch_next(struct batch *b)
+{
+	int i;
+
+	while (b->next < b->count && !b->ops[b->next].serial)
+		b->next++;
+	if (b->next < b->count) {
+		batch_call(&b->ops[b->next++]);
+		return;
+	}
+	for (i = 0 ; i < b->count ; i++)
+		if (!b->ops[i].serial)
+			batch_call(&b->ops[i]);
+	batch_unref(b);
+}
+
+static void batch (struct afb_req request)
+{
+	struct json_object *ops, *parsed, *item, *v, *a;
+	struct batchop *op;
+	struct batch *b;
+	int i, j, n;
+
+	parsed = NULL;
+	if (!json_object_object_get_ex(afb_req_json(request), "ops", &ops))
+		ops = NULL;
+	else if (json_object_is_type(ops, json_type_string))
+		ops = parsed = json_tokener_parse(json_object_get_string(ops));
+	if (!ops || !json_object_is_type(ops, json_type_array)) {
+		afb_req_fail(request, "invalid", "expected an array 'ops'");
+		json_object_put(parsed);
+		return;
+	}
+	n = json_object_array_length(ops);
+	if (n > BATCH_MAX) {
+		afb_req_fail(request, "invalid", "too many operations");
+		json_object_put(parsed);
+		return;
+	}
+	b = calloc(1, sizeof *b + n * sizeof *b->ops);
+	if (!b) {
+		afb_req_fail(request, "failed", "out of memory");
+		json_object_put(parsed);
+		return;
+	}
+
+	/* the operations refer to the json of the request that is kept */
+	afb_req_addref(request);
+	b->request = request;
+	b->parsed = parsed;
+	pthread_mutex_init(&b->mutex, NULL);
+	b->pending = n + 1;
+	b->count = n;
+	for (i = 0 ; i < n ; i++) {
+		op = &b->ops[i];
+		op->batch = b;
+		item = json_object_array_get_idx(ops, i);
+		/* only the verbs of this api, given as strings, are valid */
+		if (json_object_is_type(item, json_type_string))
+			op->verb = json_object_get_string(item);
+		else if (json_object_is_type(item, json_type_object)
+		      && json_object_object_get_ex(item, "verb", &v)
+		      && json_object_is_type(v, json_type_string)
+		      && (!json_object_object_get_ex(item, "api", &a)
+			  || (json_object_is_type(a, json_type_string)
+			      && !strcmp(json_object_get_string(a), "spotify")))) {
+			op->verb = json_object_get_string(v);
+			if (json_object_object_get_ex(item, "args", &v))
+				op->args = v;
+		}
+		if (op->verb)
+			for (j = 0 ; serial_verbs[j] ; j++)
+				if (!strcmp(op->verb, serial_verbs[j]))
+					op->serial = 1;
+	}
+	batch_next(b);
+}
+
+static void debug (struct afb_req request)
+{
+	const char *v;
+
+	v = afb_req_value(request, "level");
+	if (v)
+		trace_set_level(atoi(v));
+	afb_req_success(request, trace_dump(), NULL);
 }
 
 static int init()
 {
+	get_config();
 	atexit(do_stop);
 	afb_daemon_require_api("identity", 1);
 	afb_service_call("identity", "subscribe", NULL, NULL, NULL);
@@ -180,16 +725,94 @@ static int init()
 	return 0;
 }
 
-static void onevent_job(int signum, void *arg)
+/* moves to the state 'login', returns 0 if already in that state */
+static int transition(int login)
 {
-	if (!signum) {
+	char *previous;
+	int same;
+
+	if (login) {
+		previous = user;
+		user = NULL;
+		get_data();
+		same = pid && previous && user && !strcmp(previous, user);
+		free(previous);
+		if (same)
+			return 0;
+	} else {
+		if (!user && !pid)
+			return 0;
 		free(user); user = NULL;
 		free(reftok); reftok = NULL;
-		free(bearer); bearer = NULL;
-		do_stop();
-		if (arg)
-			run();
 	}
+	do_stop();
+	watchdog_reset();
+	if (login) {
+		do_start();
+		do_refresh();
+	}
+	open_library();
+	return 1;
+}
+
+/* count of debouncing windows after which a burst is transitioned */
+#define DEBOUNCE_MAX	4
+
+/*
+ * Job of the transitions. It waits that no event was received during
+ * the debouncing window, or at most DEBOUNCE_MAX windows from the first
+ * event, and then moves to the last state requested. The jobs are
+ * serialized on the group 'evmutex'.
+ */
+static void onevent_job(int signum, void *arg)
+{
+	long wait, end;
+	int login, done;
+
+	pthread_mutex_lock(&evmutex);
+	for (;;) {
+		end = evlast + debounce;
+		if (end > evfirst + DEBOUNCE_MAX * debounce)
+			end = evfirst + DEBOUNCE_MAX * debounce;
+		wait = end - now_ms();
+		if (signum || wait <= 0)
+			break;
+		pthread_mutex_unlock(&evmutex);
+		usleep((useconds_t)wait * 1000);
+		pthread_mutex_lock(&evmutex);
+	}
+	login = evlogin;
+	evpending = 0;
+	pthread_mutex_unlock(&evmutex);
+
+	if (signum)
+		TRACE_ERROR("transition to %s dropped on signal %d",
+				login ? "login" : "logout", signum);
+	else {
+		done = transition(login);
+		pthread_mutex_lock(&evmutex);
+		if (done)
+			evstats.executed++;
+		else
+			evstats.ignored++;
+		pthread_mutex_unlock(&evmutex);
+	}
+}
+
+/* records the state requested and queues a transition if none is pending */
+static void request_transition(int login)
+{
+	pthread_mutex_lock(&evmutex);
+	evstats.received++;
+	evlogin = login;
+	evlast = now_ms();
+	if (evpending)
+		evstats.collapsed++;
+	else if (afb_daemon_queue_job(onevent_job, NULL, &evmutex, 0) >= 0) {
+		evpending = 1;
+		evfirst = evlast;
+	}
+	pthread_mutex_unlock(&evmutex);
 }
 
 static void onevent(const char *event, struct json_object *object)
@@ -197,13 +820,14 @@ static void onevent(const char *event, struct json_object *object)
 	struct json_object *evtname;
 	const char *evt;
 
-	AFB_NOTICE("Received event: %s (%s)", event, json_object_to_json_string(object));
+	TRACE_DEBUG("received event %s (%s)", event, json_object_to_json_string(object));
 	if (json_object_object_get_ex(object, "eventName", &evtname)) {
 		evt = json_object_get_string(evtname);
+		TRACE_NOTICE("received event %s: %s", event, evt);
 		if (!strcmp("logout", evt))
-			afb_daemon_queue_job(onevent_job, NULL, onevent_job, 0);
+			request_transition(0);
 		else if (!strcmp("login", evt))
-			afb_daemon_queue_job(onevent_job, onevent_job, onevent_job, 0);
+			request_transition(1);
 	}
 }
 
@@ -213,6 +837,11 @@ static const struct afb_verb_v2 verbs[]=
 {
   {"player" , player , NULL, "player control" , AFB_SESSION_NONE },
   {"token"  , token  , NULL, "token refresh"  , AFB_SESSION_NONE },
+  {"search" , search , NULL, "library search" , AFB_SESSION_NONE },
+  {"cache"  , cache  , NULL, "page-cache warm", AFB_SESSION_NONE },
+  {"stats"  , stats  , NULL, "statistics"     , AFB_SESSION_NONE },
+  {"batch"  , batch  , NULL, "batch of verbs" , AFB_SESSION_NONE },
+  {"debug"  , debug  , NULL, "recent traces"  , AFB_SESSION_NONE },
   {NULL}
 };
 
@@ -0,0 +1,568 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Management of the audio caches of librespot.
+ *
+ * The caches are the directories <root>/<user> where librespot stores
+ * the audio files under the subdirectory 'files'. The whole tree is
+ * watched with inotify for accounting the usage, the hits (opening of
+ * an existing audio file) and the misses (creation of a new audio file)
+ * of each user. When the global usage exceeds the quota, the least
+ * recently used audio files are removed.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <json-c/json.h>
+
+#include "cache.h"
+
+#define WATCH_MASK	(IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE \
+			| IN_CLOSE_WRITE | IN_OPEN | IN_ONLYDIR)
+
+/* accounting of a user */
+struct user {
+	char *name;
+	unsigned long long usage;	/* bytes of audio files */
+	unsigned files;			/* count of audio files */
+	unsigned hits;			/* count of audio files reused */
+	unsigned misses;		/* count of audio files created */
+	unsigned evicted;		/* count of audio files removed */
+};
+
+/* an audio file */
+struct entry {
+	char *path;
+	unsigned long long size;
+	time_t used;			/* time of the last use */
+	int user;			/* index of the user */
+	int writing;			/* is being written? */
+	int warming;			/* is being opened by the warm-up? */
+};
+
+/* a watched directory */
+struct watch {
+	int wd;
+	char *path;
+};
+
+static char *root;
+static size_t rootlen;
+static unsigned long long quota;
+static unsigned long long warmsize;
+static unsigned long long usage;
+static int infd = -1;
+
+static struct user *users;
+static int nusers;
+static struct entry *entries;
+static int nentries;
+static struct watch *watches;
+static int nwatches;
+
+/* warm-up state */
+static int warming;
+static int warmstop;
+static int warmsuspend;
+static unsigned warmed;
+
+/* count of overflows of the inotify queue */
+static unsigned overflows;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* returns the index of the user of 'path' or -1 */
+static int user_of(const char *path, int *audio)
+{
+	const char *name;
+	size_t len;
+	int i;
+	struct user *u;
+
+	*audio = 0;
+	if (strncmp(path, root, rootlen) || path[rootlen] != '/')
+		return -1;
+	name = &path[rootlen + 1];
+	len = strcspn(name, "/");
+	if (!len || !name[len])
+		return -1;
+	*audio = !strncmp(&name[len], "/files/", 7);
+	for (i = 0 ; i < nusers ; i++)
+		if (!strncmp(users[i].name, name, len) && !users[i].name[len])
+			return i;
+	u = realloc(users, (size_t)(nusers + 1) * sizeof *users);
+	if (!u)
+		return -1;
+	users = u;
+	u = &users[nusers];
+	memset(u, 0, sizeof *u);
+	u->name = strndup(name, len);
+	if (!u->name)
+		return -1;
+	return nusers++;
+}
+
+static int find_user(const char *name)
+{
+	int i;
+
+	for (i = 0 ; i < nusers ; i++)
+		if (!strcmp(users[i].name, name))
+			return i;
+	return -1;
+}
+
+static struct entry *find_entry(const char *path)
+{
+	int i;
+
+	for (i = 0 ; i < nentries ; i++)
+		if (!strcmp(entries[i].path, path))
+			return &entries[i];
+	return NULL;
+}
+
+/* adds the audio file of 'path', returns it or NULL */
+static struct entry *add_entry(const char *path, struct stat *st, int writing)
+{
+	struct entry *e;
+	int user, audio;
+
+	user = user_of(path, &audio);
+	if (user < 0 || !audio)
+		return NULL;
+	e = realloc(entries, (size_t)(nentries + 1) * sizeof *entries);
+	if (!e)
+		return NULL;
+	entries = e;
+	e = &entries[nentries];
+	e->path = strdup(path);
+	if (!e->path)
+		return NULL;
+	e->size = st ? (unsigned long long)st->st_size : 0;
+	e->used = st ? (st->st_atime > st->st_mtime ? st->st_atime : st->st_mtime) : time(NULL);
+	e->user = user;
+	e->writing = writing;
+	e->warming = 0;
+	users[user].files++;
+	users[user].usage += e->size;
+	usage += e->size;
+	nentries++;
+	return e;
+}
+
+static void remove_entry(struct entry *e)
+{
+	struct user *u = &users[e->user];
+
+	u->files--;
+	u->usage -= e->size;
+	usage -= e->size;
+	free(e->path);
+	*e = entries[--nentries];
+}
+
+static void resize_entry(struct entry *e)
+{
+	struct stat st;
+
+	if (stat(e->path, &st) == 0) {
+		users[e->user].usage += (unsigned long long)st.st_size - e->size;
+		usage += (unsigned long long)st.st_size - e->size;
+		e->size = (unsigned long long)st.st_size;
+	}
+}
+
+/* removes the least recently used audio files until under the quota */
+static void enforce_quota()
+{
+	struct entry *e, *oldest;
+	unsigned long long low;
+	int i;
+
+	if (!quota || usage <= quota)
+		return;
+	low = quota - quota / 10;
+	while (usage > low) {
+		oldest = NULL;
+		for (i = 0 ; i < nentries ; i++) {
+			e = &entries[i];
+			if (!e->writing && (!oldest || e->used < oldest->used))
+				oldest = e;
+		}
+		if (!oldest)
+			break;
+		if (unlink(oldest->path) < 0 && errno != ENOENT)
+			break;
+		users[oldest->user].evicted++;
+		remove_entry(oldest);
+	}
+}
+
+static struct watch *find_watch(int wd)
+{
+	int i;
+
+	for (i = 0 ; i < nwatches ; i++)
+		if (watches[i].wd == wd)
+			return &watches[i];
+	return NULL;
+}
+
+static void add_watch(const char *path)
+{
+	struct watch *w;
+	int wd;
+
+	wd = inotify_add_watch(infd, path, WATCH_MASK);
+	if (wd < 0 || find_watch(wd))
+		return;
+	w = realloc(watches, (size_t)(nwatches + 1) * sizeof *watches);
+	if (!w)
+		return;
+	watches = w;
+	w = &watches[nwatches];
+	w->wd = wd;
+	w->path = strdup(path);
+	if (w->path)
+		nwatches++;
+}
+
+/* watches the directory 'path' and records its audio files */
+static void scan(const char *path)
+{
+	DIR *dir;
+	struct dirent *d;
+	struct stat st;
+	char *full;
+
+	add_watch(path);
+	dir = opendir(path);
+	if (!dir)
+		return;
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		if (asprintf(&full, "%s/%s", path, d->d_name) < 0)
+			continue;
+		if (lstat(full, &st) == 0) {
+			if (S_ISDIR(st.st_mode))
+				scan(full);
+			else if (S_ISREG(st.st_mode) && !find_entry(full))
+				add_entry(full, &st, 0);
+		}
+		free(full);
+	}
+	closedir(dir);
+}
+
+/* processes the inotify event 'ev' */
+static void process(struct inotify_event *ev)
+{
+	struct watch *w;
+	struct entry *e;
+	struct stat st;
+	char *full;
+
+	w = find_watch(ev->wd);
+	if (!w)
+		return;
+	if (ev->mask & IN_IGNORED) {
+		free(w->path);
+		*w = watches[--nwatches];
+		return;
+	}
+	if (!ev->len || ev->name[0] == '.')
+		return;
+	if (asprintf(&full, "%s/%s", w->path, ev->name) < 0)
+		return;
+
+	e = find_entry(full);
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			scan(full);
+	} else if (ev->mask & IN_CREATE) {
+		if (!e && (e = add_entry(full, NULL, 1)))
+			users[e->user].misses++;
+	} else if (ev->mask & IN_MOVED_TO) {
+		if (e)
+			resize_entry(e);
+		else if (stat(full, &st) == 0 && (e = add_entry(full, &st, 0)))
+			users[e->user].misses++;
+		enforce_quota();
+	} else if (ev->mask & IN_CLOSE_WRITE) {
+		if (e) {
+			e->writing = 0;
+			e->used = time(NULL);
+			resize_entry(e);
+			enforce_quota();
+		}
+	} else if (ev->mask & IN_OPEN) {
+		if (e && !e->writing) {
+			if (e->warming)
+				e->warming = 0;
+			else {
+				users[e->user].hits++;
+				e->used = time(NULL);
+			}
+		}
+	} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (e)
+			remove_entry(e);
+	}
+	free(full);
+}
+
+/* forgets the audio files and scans them again, events being lost */
+static void rescan()
+{
+	int i;
+
+	overflows++;
+	for (i = 0 ; i < nentries ; i++)
+		free(entries[i].path);
+	nentries = 0;
+	usage = 0;
+	for (i = 0 ; i < nusers ; i++) {
+		users[i].usage = 0;
+		users[i].files = 0;
+	}
+	scan(root);
+	enforce_quota();
+}
+
+/* the thread reading the inotify events */
+static void *watcher(void *arg)
+{
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *iter;
+
+	for (;;) {
+		len = read(infd, buffer, sizeof buffer);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		pthread_mutex_lock(&mutex);
+		for (iter = buffer ; iter < buffer + len ; iter += sizeof *ev + ev->len) {
+			ev = (struct inotify_event *)iter;
+			if (ev->mask & IN_Q_OVERFLOW)
+				rescan();
+			else
+				process(ev);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+/*
+ * Starts the management of the caches in 'root' with a global 'quota'
+ * in bytes (0 for no quota). 'warmsize' is the count of bytes that the
+ * warm-up of a user reads.
+ */
+int cache_init(const char *croot, unsigned long long cquota, unsigned long long cwarmsize)
+{
+	pthread_t tid;
+
+	root = strdup(croot);
+	if (!root)
+		return -1;
+	rootlen = strlen(root);
+	quota = cquota;
+	warmsize = cwarmsize;
+	mkdir(root, 0755);
+
+	infd = inotify_init1(IN_CLOEXEC);
+	if (infd < 0)
+		return -1;
+
+	pthread_mutex_lock(&mutex);
+	scan(root);
+	enforce_quota();
+	pthread_mutex_unlock(&mutex);
+
+	if (pthread_create(&tid, NULL, watcher, NULL)) {
+		close(infd);
+		infd = -1;
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+static int compare_used(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+
+	return (x->used < y->used) - (x->used > y->used);
+}
+
+/* the thread reading the most recently used audio files of a user */
+static void *warmer(void *arg)
+{
+	struct entry *list;
+	unsigned long long total;
+	struct entry *e;
+	int i, n, user, fd;
+
+	/* get the most recent audio files of the user */
+	pthread_mutex_lock(&mutex);
+	user = find_user(arg);
+	list = user < 0 ? NULL : malloc((size_t)nentries * sizeof *list);
+	for (n = i = 0 ; list && i < nentries ; i++)
+		if (entries[i].user == user && !entries[i].writing) {
+			list[n] = entries[i];
+			list[n++].path = strdup(entries[i].path);
+		}
+	pthread_mutex_unlock(&mutex);
+	free(arg);
+	qsort(list, (size_t)n, sizeof *list, compare_used);
+
+	/* read them ahead in the page cache */
+	total = 0;
+	for (i = 0 ; i < n ; i++) {
+		if (!warmstop && list[i].path && total < warmsize) {
+			pthread_mutex_lock(&mutex);
+			while (warmsuspend && !warmstop)
+				pthread_cond_wait(&cond, &mutex);
+			/* its opening isn't a hit */
+			e = find_entry(list[i].path);
+			if (e)
+				e->warming = 1;
+			pthread_mutex_unlock(&mutex);
+			fd = open(list[i].path, O_RDONLY | O_CLOEXEC);
+			if (fd >= 0) {
+				readahead(fd, 0, (size_t)list[i].size);
+				close(fd);
+				total += list[i].size;
+			}
+			pthread_mutex_lock(&mutex);
+			if (fd >= 0)
+				warmed++;
+			else if ((e = find_entry(list[i].path)))
+				e->warming = 0;
+			pthread_mutex_unlock(&mutex);
+		}
+		free(list[i].path);
+	}
+	free(list);
+
+	pthread_mutex_lock(&mutex);
+	warming = 0;
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/*
+ * Starts in background the warm-up of the cache of 'user': its most
+ * recently used audio files are read ahead in the page cache until the
+ * warm-up size. Nothing is fetched: only the files already cached by
+ * librespot are warmed.
+ */
+int cache_warm(const char *user)
+{
+	pthread_t tid;
+	char *arg;
+	int rc;
+
+	if (!root || !user)
+		return -1;
+	pthread_mutex_lock(&mutex);
+	rc = 0;
+	if (!warming) {
+		arg = strdup(user);
+		rc = arg && !pthread_create(&tid, NULL, warmer, arg) ? 0 : -1;
+		if (rc == 0) {
+			warming = 1;
+			warmstop = 0;
+			pthread_detach(tid);
+		} else
+			free(arg);
+	}
+	pthread_mutex_unlock(&mutex);
+	return rc;
+}
+
+void cache_warm_stop()
+{
+	pthread_mutex_lock(&mutex);
+	warmstop = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+/* suspends ('suspend' not null) or resumes the warm-up */
+void cache_warm_suspend(int suspend)
+{
+	pthread_mutex_lock(&mutex);
+	warmsuspend = suspend;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+struct json_object *cache_stats()
+{
+	struct json_object *result, *array, *item;
+	struct user *u;
+	unsigned hits, misses;
+	int i;
+
+	result = json_object_new_object();
+	array = json_object_new_object();
+	hits = misses = 0;
+	pthread_mutex_lock(&mutex);
+	for (i = 0 ; i < nusers ; i++) {
+		u = &users[i];
+		item = json_object_new_object();
+		json_object_object_add(item, "usage", json_object_new_int64((int64_t)u->usage));
+		json_object_object_add(item, "files", json_object_new_int64(u->files));
+		json_object_object_add(item, "hits", json_object_new_int64(u->hits));
+		json_object_object_add(item, "misses", json_object_new_int64(u->misses));
+		json_object_object_add(item, "evicted", json_object_new_int64(u->evicted));
+		json_object_object_add(array, u->name, item);
+		hits += u->hits;
+		misses += u->misses;
+	}
+	json_object_object_add(result, "quota", json_object_new_int64((int64_t)quota));
+	json_object_object_add(result, "usage", json_object_new_int64((int64_t)usage));
+	json_object_object_add(result, "hits", json_object_new_int64(hits));
+	json_object_object_add(result, "misses", json_object_new_int64(misses));
+	json_object_object_add(result, "warming", json_object_new_boolean(warming));
+	json_object_object_add(result, "warm-suspended", json_object_new_boolean(warmsuspend));
+	json_object_object_add(result, "warmed", json_object_new_int64(warmed));
+	json_object_object_add(result, "overflows", json_object_new_int64(overflows));
+	json_object_object_add(result, "users", array);
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */
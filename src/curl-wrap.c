@@ -18,8 +18,11 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <curl/curl.h>
 
@@ -27,12 +30,30 @@
 #include "escape.h"
 
 
+/* default maximum size of the decoded responses */
+#define DEFAULT_MAX_SIZE	(16 << 20)
+
 /* internal representation of buffers */
 struct buffer {
 	size_t size;
 	char *data;
+	int capped;
+	int ok;
+	char encoding[16];	/* value of the header Content-Encoding */
 };
 
+/* maximum size of the decoded responses */
+static size_t max_size = DEFAULT_MAX_SIZE;
+
+/* statistics of the transfers */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct curl_wrap_stats stats;
+static struct curl_wrap_transfer transfers[CURL_WRAP_TRANSFERS];
+static unsigned ntransfers;
+
+/* observer of the completed transfers */
+static void (*observer)(CURL *curl, int ok, const char *data, size_t size);
+
 /* write callback for filling buffers with the response */
 static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
@@ -40,7 +61,14 @@ static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdat
 	size_t sz = size * nmemb;
 	size_t old_size = buffer->size;
 	size_t new_size = old_size + sz;
-	char *data = realloc(buffer->data, new_size + 1);
+	char *data;
+
+	/* the content is decoded while received, aborts decompression bombs */
+	if (new_size > max_size) {
+		buffer->capped = 1;
+		return 0;
+	}
+	data = realloc(buffer->data, new_size + 1);
 	if (!data)
 		return 0;
 	memcpy(&data[old_size], ptr, sz);
@@ -50,6 +78,133 @@ static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdat
 	return sz;
 }
 
+/* header callback recording the content encoding of the response */
+static size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct buffer *buffer = userdata;
+	size_t sz = size * nmemb, len;
+
+	if (sz >= 5 && !strncmp(ptr, "HTTP/", 5))
+		/* a new response after a redirection */
+		buffer->encoding[0] = 0;
+	else if (sz > 17 && !strncasecmp(ptr, "content-encoding:", 17)) {
+		ptr += 17;
+		sz -= 17;
+		while (sz && (*ptr == ' ' || *ptr == '\t')) {
+			ptr++;
+			sz--;
+		}
+		len = strcspn(ptr, "\r\n");
+		if (len > sz)
+			len = sz;
+		if (len >= sizeof buffer->encoding)
+			len = sizeof buffer->encoding - 1;
+		memcpy(buffer->encoding, ptr, len);
+		buffer->encoding[len] = 0;
+	}
+	return size * nmemb;
+}
+
+/* sets the callbacks of 'curl' filling 'buffer' */
+static void set_buffer(CURL *curl, struct buffer *buffer)
+{
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, buffer);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, buffer);
+}
+
+/*
+ * Sets the maximum 'size' of the decoded content of the responses.
+ * The transfers receiving more are aborted.
+ */
+void curl_wrap_set_max_size(size_t size)
+{
+	max_size = size;
+}
+
+/* returns the count of bytes of the body received on the wire */
+static size_t wire_size(CURL *curl)
+{
+	curl_off_t wire;
+
+	if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire) != CURLE_OK)
+		return 0;
+	return (size_t)wire;
+}
+
+/* accounts the transfer of 'curl' having decoded the 'buffer' */
+static void account(CURL *curl, struct buffer *buffer)
+{
+	struct curl_wrap_transfer *t;
+	size_t wire;
+	double time;
+	char *url;
+	int encoded;
+
+	wire = wire_size(curl);
+	if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &time) != CURLE_OK)
+		time = 0;
+	if (curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK || !url)
+		url = "";
+	encoded = buffer->encoding[0] && strcasecmp(buffer->encoding, "identity");
+	pthread_mutex_lock(&mutex);
+	stats.transfers++;
+	if (encoded)
+		stats.encoded++;
+	if (buffer->capped)
+		stats.capped++;
+	stats.wire += wire;
+	stats.decoded += buffer->size;
+	stats.time_us += (unsigned long long)(time * 1000000);
+	t = &transfers[ntransfers++ % CURL_WRAP_TRANSFERS];
+	snprintf(t->url, sizeof t->url, "%s", url);
+	memcpy(t->encoding, buffer->encoding, sizeof t->encoding);
+	t->ok = buffer->ok;
+	t->capped = buffer->capped;
+	t->wire = wire;
+	t->decoded = buffer->size;
+	t->time_us = (unsigned long long)(time * 1000000);
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Sets the 'callback' called after each completed transfer with its
+ * status and its decoded content (data is NULL when empty), or removes
+ * it when 'callback' is NULL. It can be called concurrently from several
+ * threads.
+ */
+void curl_wrap_set_observer(void (*callback)(CURL *curl, int ok, const char *data, size_t size))
+{
+	observer = callback;
+}
+
+/* copies the statistics of the transfers in 'result' */
+void curl_wrap_get_stats(struct curl_wrap_stats *result)
+{
+	pthread_mutex_lock(&mutex);
+	*result = stats;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Copies in 'result' the last transfers, at most 'count', from the
+ * oldest. Returns the count of transfers copied.
+ */
+int curl_wrap_get_transfers(struct curl_wrap_transfer *result, int count)
+{
+	unsigned i, n;
+
+	pthread_mutex_lock(&mutex);
+	n = ntransfers < CURL_WRAP_TRANSFERS ? ntransfers : CURL_WRAP_TRANSFERS;
+	if (count >= 0 && n > (unsigned)count)
+		n = (unsigned)count;
+	for (i = 0 ; i < n ; i++)
+		result[i] = transfers[(ntransfers - n + i) % CURL_WRAP_TRANSFERS];
+	pthread_mutex_unlock(&mutex);
+	return (int)n;
+}
+
 /* 
  * Perform the CURL operation for 'curl' and put the result in
  * memory. If 'result' isn't NULL it receives the returned content
@@ -68,14 +223,19 @@ int curl_wrap_perform(CURL *curl, char **result, size_t *size)
 	/* init tthe buffer */
 	buffer.size = 0;
 	buffer.data = NULL;
+	buffer.capped = 0;
+	buffer.encoding[0] = 0;
 
 	/* Perform the request, res will get the return code */ 
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+	set_buffer(curl, &buffer);
 
 	/* Perform the request, res will get the return code */ 
 	code = curl_easy_perform(curl);
 	rc = code == CURLE_OK;
+	buffer.ok = rc;
+	account(curl, &buffer);
+	if (observer)
+		observer(curl, rc, buffer.data, buffer.size);
 
 	/* Check for no errors */ 
 	if (rc) {
@@ -98,6 +258,126 @@ int curl_wrap_perform(CURL *curl, char **result, size_t *size)
 	return rc;
 }
 
+/* returns the current monotonic time in milliseconds */
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Perform the CURL operations of the 'count' handles of 'curls' as a
+ * hedged race. The first handle is started immediately. The next one is
+ * started either when a started handle fails or when 'delay' milliseconds
+ * elapsed since the last start without any success (a negative 'delay'
+ * never hedges). The first handle that succeeds wins and the others are
+ * aborted. If not NULL, 'status' receives for each handle 1 if it
+ * succeeded, 0 if it failed, -1 if it was aborted and -2 if it wasn't
+ * started. If not NULL, 'elapsed' receives for each started handle the
+ * milliseconds elapsed until its completion or its abortion.
+ * Returns the index of the winner whose content is put in 'result' and
+ * 'size' as for curl_wrap_perform, or -1 if all handles failed.
+ * The handles remain owned by the caller.
+ */
+int curl_wrap_perform_race(CURL **curls, int count, long delay, int *status, long *elapsed, char **result, size_t *size)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	struct buffer *buffers;
+	long *starts;
+	int i, started, running, winner, failed, nmsg;
+	long last, wait;
+
+	winner = -1;
+	for (i = 0 ; i < count ; i++) {
+		if (status)
+			status[i] = -2;
+		if (elapsed)
+			elapsed[i] = 0;
+	}
+	buffers = calloc((size_t)count, sizeof *buffers);
+	starts = calloc((size_t)count, sizeof *starts);
+	multi = buffers && starts ? curl_multi_init() : NULL;
+	if (multi) {
+		for (i = 0 ; i < count ; i++)
+			set_buffer(curls[i], &buffers[i]);
+		started = running = 0;
+		failed = 1;
+		last = 0;
+		while (winner < 0) {
+			/* start the next handle if needed */
+			if (started < count
+			 && (failed || (delay >= 0 && now_ms() - last >= delay))) {
+				if (status)
+					status[started] = -1;
+				last = now_ms();
+				starts[started] = last;
+				curl_multi_add_handle(multi, curls[started++]);
+				failed = 0;
+			}
+			if (curl_multi_perform(multi, &running) != CURLM_OK)
+				break;
+
+			/* inspect completed handles */
+			while (winner < 0 && (msg = curl_multi_info_read(multi, &nmsg))) {
+				if (msg->msg != CURLMSG_DONE)
+					continue;
+				for (i = 0 ; curls[i] != msg->easy_handle ; i++);
+				if (msg->data.result == CURLE_OK)
+					winner = i;
+				else
+					failed = 1;
+				buffers[i].ok = msg->data.result == CURLE_OK;
+				if (status)
+					status[i] = buffers[i].ok;
+				if (elapsed)
+					elapsed[i] = now_ms() - starts[i];
+				if (observer)
+					observer(curls[i], msg->data.result == CURLE_OK,
+						buffers[i].data, buffers[i].size);
+				curl_multi_remove_handle(multi, curls[i]);
+			}
+			if (winner >= 0 || (!running && started == count))
+				break;
+
+			/* wait activity or the next hedging time */
+			wait = 1000;
+			if (started < count && delay >= 0) {
+				wait = last + delay - now_ms();
+				if (wait < 0)
+					wait = 0;
+			}
+			if (running)
+				curl_multi_wait(multi, NULL, 0, (int)wait, NULL);
+		}
+
+		/* abort the losers */
+		for (i = 0 ; i < started ; i++) {
+			if (elapsed && !elapsed[i])
+				elapsed[i] = now_ms() - starts[i];
+			curl_multi_remove_handle(multi, curls[i]);
+			account(curls[i], &buffers[i]);
+		}
+		curl_multi_cleanup(multi);
+	}
+
+	/* deliver the result */
+	for (i = 0 ; buffers && i < count ; i++)
+		if (i != winner)
+			free(buffers[i].data);
+	if (size)
+		*size = winner < 0 ? 0 : buffers[winner].size;
+	if (result)
+		*result = winner < 0 ? NULL : buffers[winner].data;
+	else if (winner >= 0)
+		free(buffers[winner].data);
+	free(buffers);
+	free(starts);
+	return winner;
+}
+
 void curl_wrap_do(CURL *curl, void (*callback)(void *closure, int status, CURL *curl, const char *result, size_t size), void *closure)
 {
 	int rc;
@@ -135,6 +415,9 @@ CURL *curl_wrap_prepare_get_url(const char *url)
 	curl = curl_easy_init();
 	if(curl) {
 		code = curl_easy_setopt(curl, CURLOPT_URL, url);
+		/* accepts all the encodings supported: gzip, deflate, br... */
+		if (code == CURLE_OK)
+			code = curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
 		if (code == CURLE_OK)
 			return curl;
 		curl_easy_cleanup(curl);
@@ -185,6 +468,7 @@ CURL *curl_wrap_prepare_post_url_data(const char *url, const char *datatype, con
 	curl = curl_easy_init();
 	if (curl
 	 && CURLE_OK == curl_easy_setopt(curl, CURLOPT_URL, url)
+	 && CURLE_OK == curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "")
 	 && (!szdata || CURLE_OK == curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, szdata))
 	 && CURLE_OK == curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data)
 	 && (!datatype || curl_wrap_add_header_value(curl, "content-type", datatype)))
@@ -20,11 +20,37 @@
 
 #include <curl/curl.h>
 
+/* statistics of the transfers */
+struct curl_wrap_stats {
+	unsigned long long transfers;	/* count of transfers */
+	unsigned long long encoded;	/* count of transfers compressed */
+	unsigned long long capped;	/* count of transfers too big */
+	unsigned long long wire;	/* bytes received on the wire */
+	unsigned long long decoded;	/* bytes after decoding */
+	unsigned long long time_us;	/* cumulated time of the transfers */
+};
+
+/* count of the last transfers kept */
+#define CURL_WRAP_TRANSFERS	16
+
+/* a transfer */
+struct curl_wrap_transfer {
+	char url[100];			/* its URL, truncated */
+	char encoding[16];		/* its content encoding or "" */
+	int ok;				/* did it succeed? */
+	int capped;			/* was it too big? */
+	unsigned long long wire;	/* bytes received on the wire */
+	unsigned long long decoded;	/* bytes after decoding */
+	unsigned long long time_us;	/* time of the transfer */
+};
+
 extern char *curl_wrap_url (const char *base, const char *path,
                             const char *const *query, size_t * size);
 
 extern int curl_wrap_perform (CURL * curl, char **result, size_t * size);
 
+extern int curl_wrap_perform_race(CURL **curls, int count, long delay, int *status, long *elapsed, char **result, size_t *size);
+
 extern void curl_wrap_do(CURL *curl, void (*callback)(void *closure, int status, CURL *curl, const char *result, size_t size), void *closure);
 
 extern int curl_wrap_content_type_is (CURL * curl, const char *value);
@@ -41,5 +67,13 @@ extern int curl_wrap_add_header(CURL *curl, const char *header);
 
 extern int curl_wrap_add_header_value(CURL *curl, const char *name, const char *value);
 
+extern void curl_wrap_set_max_size(size_t size);
+
+extern void curl_wrap_get_stats(struct curl_wrap_stats *stats);
+
+extern int curl_wrap_get_transfers(struct curl_wrap_transfer *transfers, int count);
+
+extern void curl_wrap_set_observer(void (*callback)(CURL *curl, int ok, const char *data, size_t size));
+
 /* vim: set colorcolumn=80: */
 
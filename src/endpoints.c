@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <json-c/json.h>
+
+#include "curl-wrap.h"
+#include "endpoints.h"
+
+/* maximum count of endpoints */
+#define MAX_ENDPOINTS	8
+
+/* count of latency samples kept for computing percentiles */
+#define SAMPLES		32
+
+/* minimal count of samples for using the percentile as hedging delay */
+#define MIN_SAMPLES	8
+
+/* weight of the new values in the moving averages */
+#define ALPHA		0.2
+
+/* weight of the error penalty of a request aborted by a hedged one */
+#define ALPHA_ABORT	0.1
+
+/* error rate above which an endpoint is unhealthy */
+#define MAX_ERROR_RATE	0.5
+
+/* delay in seconds before probing again an unhealthy endpoint */
+#define RETRY_DELAY	30
+
+/* the statistics of one endpoint */
+struct endpoint {
+	char *url;		/* base url */
+	double latency;		/* moving average of the latency in ms */
+	double errors;		/* moving average of the error rate */
+	unsigned requests;	/* count of requests started */
+	unsigned failures;	/* count of requests failed */
+	unsigned hedged;	/* count of hedged requests started */
+	unsigned wins;		/* count of requests answered */
+	time_t retry;		/* when unhealthy, time of the next probe */
+	int healthy;		/* health when ordering the endpoints */
+	unsigned nsamples;	/* count of samples recorded */
+	float samples[SAMPLES];	/* ring of the last latencies */
+};
+
+static struct endpoint endpoints[MAX_ENDPOINTS];
+static int count;
+static int percentile = 95;
+static long default_delay = 500;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int endpoints_add(const char *url)
+{
+	char *u;
+
+	if (count >= MAX_ENDPOINTS)
+		return 0;
+	u = strdup(url);
+	if (!u)
+		return 0;
+	memset(&endpoints[count], 0, sizeof endpoints[count]);
+	endpoints[count++].url = u;
+	return 1;
+}
+
+void endpoints_set_hedging(int pc, long delay)
+{
+	if (pc > 0 && pc <= 100)
+		percentile = pc;
+	default_delay = delay;
+}
+
+static int is_healthy(struct endpoint *ep, time_t now)
+{
+	return ep->errors < MAX_ERROR_RATE || ep->retry <= now;
+}
+
+/* order the endpoints: healthy first by latency then by error rate */
+static int compare(const void *a, const void *b)
+{
+	const struct endpoint *x = *(const struct endpoint * const *)a;
+	const struct endpoint *y = *(const struct endpoint * const *)b;
+
+	if (x->healthy != y->healthy)
+		return y->healthy - x->healthy;
+	if (x->healthy)
+		return (x->latency > y->latency) - (x->latency < y->latency);
+	return (x->errors > y->errors) - (x->errors < y->errors);
+}
+
+static int compare_float(const void *a, const void *b)
+{
+	float x = *(const float*)a, y = *(const float*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* computes the hedging delay of 'ep' */
+static long hedging_delay(struct endpoint *ep)
+{
+	float sorted[SAMPLES];
+	unsigned n;
+
+	n = ep->nsamples < SAMPLES ? ep->nsamples : SAMPLES;
+	if (n < MIN_SAMPLES)
+		return default_delay;
+	memcpy(sorted, ep->samples, n * sizeof *sorted);
+	qsort(sorted, n, sizeof *sorted, compare_float);
+	return (long)sorted[(n * (unsigned)percentile - 1) / 100];
+}
+
+/* adds the latency 'value' in ms to the statistics of 'ep' */
+static void add_latency(struct endpoint *ep, double value)
+{
+	ep->latency = ep->nsamples ? ep->latency + ALPHA * (value - ep->latency) : value;
+	ep->samples[ep->nsamples++ % SAMPLES] = (float)value;
+}
+
+/*
+ * Records the outcome of a request to 'ep' that lasted 'elapsed' ms.
+ * A request aborted because a hedged one won is a censored sample: its
+ * latency is at least 'elapsed' and it is penalized a bit as an error.
+ */
+static void record(struct endpoint *ep, int status, long elapsed, CURL *curl)
+{
+	double total;
+
+	if (status == -2)
+		return;
+	if (status < 0) {
+		if (elapsed > ep->latency)
+			add_latency(ep, (double)elapsed);
+		ep->errors += ALPHA_ABORT * (1 - ep->errors);
+		if (ep->errors >= MAX_ERROR_RATE)
+			ep->retry = time(NULL) + RETRY_DELAY;
+	} else if (status) {
+		total = 0;
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+		add_latency(ep, total * 1000);
+		ep->errors -= ALPHA * ep->errors;
+		ep->wins++;
+	} else {
+		ep->errors += ALPHA * (1 - ep->errors);
+		ep->failures++;
+		if (ep->errors >= MAX_ERROR_RATE)
+			ep->retry = time(NULL) + RETRY_DELAY;
+	}
+}
+
+/*
+ * Get the content of 'path' from the best endpoint. The request is hedged
+ * to the next endpoint when its latency exceeds the configured percentile
+ * and it fails over the next endpoints on errors.
+ * The result is returned as for curl_wrap_perform.
+ */
+int endpoints_get(const char *path, char **result, size_t *size)
+{
+	struct endpoint *order[MAX_ENDPOINTS];
+	CURL *curls[MAX_ENDPOINTS];
+	int status[MAX_ENDPOINTS];
+	long elapsed[MAX_ENDPOINTS];
+	int i, n, rc;
+	long delay;
+	time_t now;
+	char *url;
+
+	/* choose the order of the endpoints, their health being fixed */
+	pthread_mutex_lock(&mutex);
+	now = time(NULL);
+	for (i = 0 ; i < count ; i++) {
+		order[i] = &endpoints[i];
+		order[i]->healthy = is_healthy(order[i], now);
+	}
+	qsort(order, (size_t)count, sizeof *order, compare);
+	delay = count > 1 ? hedging_delay(order[0]) : -1;
+	pthread_mutex_unlock(&mutex);
+
+	/* prepare the requests */
+	for (n = i = 0 ; i < count ; i++) {
+		rc = asprintf(&url, "%s%s", order[i]->url, path);
+		if (rc >= 0) {
+			curls[n] = curl_wrap_prepare_get_url(url);
+			free(url);
+			if (curls[n]) {
+				curl_easy_setopt(curls[n], CURLOPT_FAILONERROR, 1L);
+				order[n++] = order[i];
+			}
+		}
+	}
+
+	/* race the requests */
+	rc = curl_wrap_perform_race(curls, n, delay, status, elapsed, result, size);
+
+	/* record the statistics */
+	pthread_mutex_lock(&mutex);
+	for (i = 0 ; i < n ; i++) {
+		if (status[i] != -2) {
+			order[i]->requests++;
+			if (i)
+				order[i]->hedged++;
+		}
+		record(order[i], status[i], elapsed[i], curls[i]);
+		curl_easy_cleanup(curls[i]);
+	}
+	pthread_mutex_unlock(&mutex);
+	return rc >= 0;
+}
+
+struct json_object *endpoints_stats()
+{
+	struct json_object *array, *item;
+	struct endpoint *ep;
+	time_t now;
+	int i;
+
+	now = time(NULL);
+	array = json_object_new_array();
+	pthread_mutex_lock(&mutex);
+	for (i = 0 ; i < count ; i++) {
+		ep = &endpoints[i];
+		item = json_object_new_object();
+		json_object_object_add(item, "url", json_object_new_string(ep->url));
+		json_object_object_add(item, "healthy", json_object_new_boolean(is_healthy(ep, now)));
+		json_object_object_add(item, "latency", json_object_new_double(ep->latency));
+		json_object_object_add(item, "error-rate", json_object_new_double(ep->errors));
+		json_object_object_add(item, "hedging-delay", json_object_new_int64(hedging_delay(ep)));
+		json_object_object_add(item, "requests", json_object_new_int64(ep->requests));
+		json_object_object_add(item, "hedged", json_object_new_int64(ep->hedged));
+		json_object_object_add(item, "answered", json_object_new_int64(ep->wins));
+		json_object_object_add(item, "failures", json_object_new_int64(ep->failures));
+		json_object_array_add(array, item);
+	}
+	pthread_mutex_unlock(&mutex);
+	return array;
+}
+
+/* vim: set colorcolumn=80: */
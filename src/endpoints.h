@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+
+struct json_object;
+
+extern int endpoints_add(const char *url);
+extern void endpoints_set_hedging(int percentile, long delay);
+extern int endpoints_get(const char *path, char **result, size_t *size);
+extern struct json_object *endpoints_stats();
+
+/* vim: set colorcolumn=80: */
@@ -402,7 +402,7 @@ char *unescape(const char *text, size_t textlen, size_t *reslength)
 	return result;
 }
 
-#if 1
+#if defined(ESCAPE_TEST)
 #include <stdio.h>
 int main(int ac, char **av)
 {
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Benchmark of the index of the library on a synthetic library.
+ *
+ *   library-bench [COUNT [DIRECTORY]]
+ *
+ * Generates COUNT tracks (default 10000) with a fixed seed, writes their
+ * index in DIRECTORY/bench/library.idx (default /tmp/library-bench),
+ * and reports the time of the writing, the size of the index and the
+ * latency of a few queries.
+ */
+
+#include <stdarg.h>
+
+/* the internals of the index are needed */
+#include "library.c"
+
+static const char *const words[] = {
+	"love", "night", "blue", "summer", "dream", "fire", "heart",
+	"rain", "city", "dance", "moon", "road", "gold", "wild", "sky",
+	"storm", "river", "light", "shadow", "echo"
+};
+#define NWORDS	(int)(sizeof words / sizeof *words)
+
+static const char *const queries[] = {
+	"love ni", "artist12 blu", "album gold summer", "echo", "zzz", NULL
+};
+
+static char *fmt(const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+
+	va_start(ap, fmt);
+	if (vasprintf(&s, fmt, ap) < 0)
+		s = NULL;
+	va_end(ap);
+	return s;
+}
+
+int main(int ac, char **av)
+{
+	struct record *recs;
+	struct json_object *result;
+	const char *dir;
+	char *path;
+	size_t i, n;
+	long start, end;
+	int q, rc;
+
+	n = ac > 1 ? (size_t)atol(av[1]) : 10000;
+	dir = ac > 2 ? av[2] : "/tmp/library-bench";
+	recs = calloc(n, sizeof *recs);
+	if (!recs)
+		return 1;
+
+	/* the synthetic library */
+	srand(1);
+	for (i = 0 ; i < n ; i++) {
+		recs[i].id = fmt("id%zu", i);
+		recs[i].name = fmt("%s %s %zu", words[rand() % NWORDS],
+					words[rand() % NWORDS], i);
+		recs[i].artist = fmt("Artist%d %s", rand() % 500,
+					words[rand() % NWORDS]);
+		recs[i].album = fmt("Album %s", words[rand() % NWORDS]);
+		recs[i].source = i % 3 ? "saved" : "playlist";
+	}
+
+	/* write the index */
+	path = fmt("%s/bench", dir);
+	mkdir(dir, 0755);
+	mkdir(path, 0755);
+	free(path);
+	path = fmt("%s/bench/library.idx", dir);
+	start = now_us();
+	rc = index_write(path, recs, n);
+	end = now_us();
+	free(path);
+	if (rc < 0) {
+		fprintf(stderr, "can't write the index in %s\n", dir);
+		return 1;
+	}
+	printf("tracks %zu, written in %ld ms\n", n, (end - start) / 1000);
+
+	/* query it */
+	if (library_init(dir, "") < 0 || library_open("bench") < 0) {
+		fprintf(stderr, "can't open the index\n");
+		return 1;
+	}
+	printf("size %zu bytes, tokens %u\n", active.size, active.header->ntokens);
+	for (q = 0 ; queries[q] ; q++) {
+		start = now_us();
+		result = library_search(queries[q], 20);
+		end = now_us();
+		printf("query '%s': %zu results in %ld us\n", queries[q],
+			json_object_array_length(result), end - start);
+		json_object_put(result);
+	}
+	return 0;
+}
+
+/* vim: set colorcolumn=80: */
@@ -0,0 +1,1089 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Local index of the library of the users.
+ *
+ * The saved tracks and the tracks of the playlists of a user are
+ * recorded in the file <root>/<user>/library.idx that is memory mapped
+ * for searching them offline. The file is made of:
+ *
+ *  - a header giving the counts of the parts that follow
+ *  - the tracks, made of offsets in the strings
+ *  - the tokens of the tracks, sorted, each with its list of postings
+ *  - the postings, indexes of the tracks having the tokens
+ *  - the strings
+ *
+ * The synchronisation with the Web API is incremental: the saved tracks
+ * are fetched until the 'added_at' of the last synchronisation and only
+ * the playlists whose 'snapshot_id' changed are fetched again. The state
+ * of the synchronisation is recorded in <root>/<user>/library.json.
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <json-c/json.h>
+
+#include "curl-wrap.h"
+#include "tokens.h"
+#include "library.h"
+#include "replay.h"
+
+#define MAGIC		"SPLIBIX2"
+
+/* maximum length of the tokens */
+#define TOKEN_MAX	32
+
+/* maximum count of tokens of a query */
+#define QUERY_MAX	8
+
+/* maximum count of results of a query */
+#define RESULTS_MAX	100
+
+/* mark of the tracks already in the results of a query */
+#define FOUND		0xffff
+
+/* header of the index file */
+struct header {
+	char magic[8];
+	uint32_t ntracks;
+	uint32_t ntokens;
+	uint32_t npostings;
+	uint32_t strsize;
+};
+
+/* a track of the index file, made of offsets in the strings */
+struct itrack {
+	uint32_t id;
+	uint32_t name;
+	uint32_t artist;
+	uint32_t album;
+	uint32_t source;
+	uint32_t first;		/* index of the first track of the same id */
+};
+
+/* a token of the index file */
+struct itoken {
+	uint32_t word;		/* offset of the token in the strings */
+	uint32_t first;		/* index of its first posting */
+	uint32_t count;		/* count of its postings */
+};
+
+/* a mapped index */
+struct index {
+	void *base;
+	size_t size;
+	const struct header *header;
+	const struct itrack *tracks;
+	const struct itoken *tokens;
+	const uint32_t *postings;
+	const char *strings;
+};
+
+/* a track while synchronising */
+struct record {
+	const char *id;
+	const char *name;
+	const char *artist;
+	const char *album;
+	const char *source;
+};
+
+struct records {
+	struct record *items;
+	size_t count;
+	size_t alloc;
+};
+
+/* growable buffer */
+struct buf {
+	char *data;
+	size_t size;
+	size_t alloc;
+};
+
+/* block of strings allocated while synchronising */
+struct block {
+	struct block *next;
+	char data[];
+};
+
+/* state of a synchronisation */
+struct sync {
+	char *user;
+	char *auth;
+	struct block *strings;
+	unsigned pages;
+};
+
+static char *root;
+static char *webapi;
+static char *active_user;
+static struct index active;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int syncing;
+static const char *syncuser;	/* the user being synchronised */
+static char *pending;		/* the user to synchronise next */
+static struct {
+	unsigned syncs;		/* count of synchronisations done */
+	unsigned failures;	/* count of synchronisations failed */
+	long duration;		/* duration in ms of the last synchronisation */
+	unsigned pages;		/* count of pages fetched by the last one */
+	unsigned queries;	/* count of queries */
+	long latency;		/* latency in us of the last query */
+	long long total;	/* total latency in us of the queries */
+} st;
+
+static long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/******************************************************************/
+/* buffers and strings                                            */
+/******************************************************************/
+
+static int buf_add(struct buf *buf, const void *data, size_t size)
+{
+	size_t alloc;
+	char *p;
+
+	if (buf->size + size > buf->alloc) {
+		alloc = buf->alloc ? buf->alloc : 4096;
+		while (alloc < buf->size + size)
+			alloc <<= 1;
+		p = realloc(buf->data, alloc);
+		if (!p)
+			return -1;
+		buf->data = p;
+		buf->alloc = alloc;
+	}
+	memcpy(&buf->data[buf->size], data, size);
+	buf->size += size;
+	return 0;
+}
+
+/* adds the string 's' to the pool 'buf', returns its offset or 0 */
+static uint32_t buf_str(struct buf *buf, const char *s)
+{
+	size_t off = buf->size;
+
+	if (!s || !*s || buf_add(buf, s, strlen(s) + 1) < 0)
+		return 0;
+	return (uint32_t)off;
+}
+
+/* duplicates 's' in the strings of 'sync' */
+static const char *sync_strdup(struct sync *sync, const char *s)
+{
+	struct block *b;
+	size_t len;
+
+	if (!s)
+		return NULL;
+	len = strlen(s) + 1;
+	b = malloc(sizeof *b + len);
+	if (!b)
+		return NULL;
+	memcpy(b->data, s, len);
+	b->next = sync->strings;
+	sync->strings = b;
+	return b->data;
+}
+
+static int records_add(struct records *recs, const struct record *rec)
+{
+	struct record *items;
+	size_t alloc;
+
+	if (recs->count == recs->alloc) {
+		alloc = recs->alloc ? 2 * recs->alloc : 256;
+		items = realloc(recs->items, alloc * sizeof *items);
+		if (!items)
+			return -1;
+		recs->items = items;
+		recs->alloc = alloc;
+	}
+	recs->items[recs->count++] = *rec;
+	return 0;
+}
+
+/******************************************************************/
+/* tokens                                                         */
+/******************************************************************/
+
+/* is 'c' part of tokens? the bytes of UTF-8 sequences are */
+static int is_token_char(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+		|| (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+/*
+ * Calls 'fn' for each token of 'text'. The tokens are lower cased and
+ * truncated to TOKEN_MAX bytes.
+ */
+static int tokenize(const char *text, int (*fn)(void *closure, const char *token), void *closure)
+{
+	char token[TOKEN_MAX + 1];
+	unsigned char c;
+	size_t len;
+	int rc;
+
+	len = 0;
+	rc = 0;
+	while (text && rc >= 0) {
+		c = (unsigned char)*text++;
+		if (is_token_char(c)) {
+			if (len < TOKEN_MAX)
+				token[len++] = (char)(c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c);
+		} else {
+			if (len) {
+				token[len] = 0;
+				rc = fn(closure, token);
+				len = 0;
+			}
+			if (!c)
+				break;
+		}
+	}
+	return rc;
+}
+
+/******************************************************************/
+/* index files                                                    */
+/******************************************************************/
+
+static void index_unmap(struct index *ix)
+{
+	if (ix->base)
+		munmap(ix->base, ix->size);
+	memset(ix, 0, sizeof *ix);
+}
+
+/* maps the index file 'path' in 'ix' */
+static int index_map(struct index *ix, const char *path)
+{
+	const struct header *h;
+	struct stat s;
+	size_t size;
+	uint32_t i;
+	void *base;
+	int fd;
+
+	memset(ix, 0, sizeof *ix);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &s) < 0 || (size_t)s.st_size < sizeof *h) {
+		close(fd);
+		return -1;
+	}
+	base = mmap(NULL, (size_t)s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	/* check the index */
+	h = base;
+	size = sizeof *h
+		+ (size_t)h->ntracks * sizeof(struct itrack)
+		+ (size_t)h->ntokens * sizeof(struct itoken)
+		+ (size_t)h->npostings * sizeof(uint32_t)
+		+ (size_t)h->strsize;
+	if (memcmp(h->magic, MAGIC, sizeof h->magic) || size != (size_t)s.st_size
+	 || !h->strsize || ((const char*)base)[size - 1]) {
+		munmap(base, (size_t)s.st_size);
+		return -1;
+	}
+
+	ix->base = base;
+	ix->size = size;
+	ix->header = h;
+	ix->tracks = (const struct itrack*)(h + 1);
+	ix->tokens = (const struct itoken*)(ix->tracks + h->ntracks);
+	ix->postings = (const uint32_t*)(ix->tokens + h->ntokens);
+	ix->strings = (const char*)(ix->postings + h->npostings);
+
+	/* check the ranges, the file may be corrupted */
+	for (i = 0 ; i < h->ntracks ; i++)
+		if (ix->tracks[i].first >= h->ntracks)
+			goto invalid;
+	for (i = 0 ; i < h->ntokens ; i++)
+		if (ix->tokens[i].word >= h->strsize
+		 || ix->tokens[i].first > h->npostings
+		 || ix->tokens[i].count > h->npostings - ix->tokens[i].first)
+			goto invalid;
+	return 0;
+
+invalid:
+	index_unmap(ix);
+	return -1;
+}
+
+static const char *ixstr(const struct index *ix, uint32_t off)
+{
+	return off < ix->header->strsize ? &ix->strings[off] : "";
+}
+
+/* a token of a track while writing the index */
+struct pair {
+	uint32_t word;		/* offset of the token in the words */
+	uint32_t track;		/* index of the track */
+};
+
+struct collect {
+	struct buf *words;
+	struct buf *pairs;
+	uint32_t track;
+};
+
+static int collect_token(void *closure, const char *token)
+{
+	struct collect *c = closure;
+	struct pair p;
+
+	p.word = (uint32_t)c->words->size;
+	p.track = c->track;
+	return buf_add(c->words, token, strlen(token) + 1) < 0 ? -1
+		: buf_add(c->pairs, &p, sizeof p);
+}
+
+static int compare_pairs(const void *a, const void *b, void *words)
+{
+	const struct pair *x = a, *y = b;
+	int rc = strcmp((char*)words + x->word, (char*)words + y->word);
+
+	return rc ? rc : (x->track > y->track) - (x->track < y->track);
+}
+
+static int compare_ids(const void *a, const void *b, void *recs)
+{
+	const struct record *r = recs;
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	int rc = strcmp(r[x].id ?: "", r[y].id ?: "");
+
+	return rc ? rc : (x > y) - (x < y);
+}
+
+/* writes the index of the 'count' records of 'recs' in the file 'path' */
+static int index_write(const char *path, const struct record *recs, size_t count)
+{
+	struct buf strings = { 0 }, words = { 0 }, pairs = { 0 };
+	struct buf tracks = { 0 }, tokens = { 0 }, postings = { 0 };
+	struct collect col;
+	struct header h;
+	struct itrack t;
+	struct itoken k;
+	struct pair *p;
+	const char *word, *source;
+	uint32_t srcoff, head, *order, *first;
+	size_t i, n;
+	char *tmp;
+	FILE *f;
+	int rc, ok;
+
+	rc = -1;
+	source = NULL;
+	srcoff = 0;
+	buf_add(&strings, "", 1);
+
+	/* the first track of each id, the tracks being in several sources */
+	order = malloc((count ?: 1) * sizeof *order);
+	first = malloc((count ?: 1) * sizeof *first);
+	if (!order || !first)
+		goto end;
+	for (i = 0 ; i < count ; i++)
+		order[i] = (uint32_t)i;
+	qsort_r(order, count, sizeof *order, compare_ids, (void*)recs);
+	for (i = 0 ; i < count ; i++) {
+		if (!i || strcmp(recs[order[i - 1]].id ?: "", recs[order[i]].id ?: ""))
+			head = order[i];
+		first[order[i]] = head;
+	}
+
+	/* the tracks and their tokens */
+	col.words = &words;
+	col.pairs = &pairs;
+	for (i = 0 ; i < count ; i++) {
+		t.id = buf_str(&strings, recs[i].id);
+		t.name = buf_str(&strings, recs[i].name);
+		t.artist = buf_str(&strings, recs[i].artist);
+		t.album = buf_str(&strings, recs[i].album);
+		if (source != recs[i].source) {
+			source = recs[i].source;
+			srcoff = buf_str(&strings, source);
+		}
+		t.source = srcoff;
+		t.first = first[i];
+		col.track = (uint32_t)i;
+		if (buf_add(&tracks, &t, sizeof t) < 0
+		 || tokenize(recs[i].name, collect_token, &col) < 0
+		 || tokenize(recs[i].artist, collect_token, &col) < 0
+		 || tokenize(recs[i].album, collect_token, &col) < 0)
+			goto end;
+	}
+
+	/* the sorted tokens and their postings */
+	n = pairs.size / sizeof *p;
+	p = (struct pair*)pairs.data;
+	qsort_r(p, n, sizeof *p, compare_pairs, words.data);
+	word = NULL;
+	k.count = 0;
+	for (i = 0 ; i < n ; i++) {
+		if (!word || strcmp(word, words.data + p[i].word)) {
+			if (word && buf_add(&tokens, &k, sizeof k) < 0)
+				goto end;
+			word = words.data + p[i].word;
+			k.word = buf_str(&strings, word);
+			k.first = (uint32_t)(postings.size / sizeof(uint32_t));
+			k.count = 0;
+		} else if (p[i].track == p[i - 1].track)
+			continue;
+		if (buf_add(&postings, &p[i].track, sizeof p[i].track) < 0)
+			goto end;
+		k.count++;
+	}
+	if (word && buf_add(&tokens, &k, sizeof k) < 0)
+		goto end;
+
+	/* write the file */
+	memcpy(h.magic, MAGIC, sizeof h.magic);
+	h.ntracks = (uint32_t)count;
+	h.ntokens = (uint32_t)(tokens.size / sizeof k);
+	h.npostings = (uint32_t)(postings.size / sizeof(uint32_t));
+	h.strsize = (uint32_t)strings.size;
+	if (asprintf(&tmp, "%s.tmp", path) < 0)
+		goto end;
+	f = fopen(tmp, "we");
+	if (f) {
+		ok = fwrite(&h, sizeof h, 1, f) == 1
+		  && fwrite(tracks.data, 1, tracks.size, f) == tracks.size
+		  && fwrite(tokens.data, 1, tokens.size, f) == tokens.size
+		  && fwrite(postings.data, 1, postings.size, f) == postings.size
+		  && fwrite(strings.data, 1, strings.size, f) == strings.size;
+		/* closed on every path, a short write being usual on ENOSPC */
+		if (fclose(f) == 0 && ok)
+			rc = rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+	free(tmp);
+end:
+	free(order);
+	free(first);
+	free(strings.data);
+	free(words.data);
+	free(pairs.data);
+	free(tracks.data);
+	free(tokens.data);
+	free(postings.data);
+	return rc;
+}
+
+/******************************************************************/
+/* synchronisation                                                */
+/******************************************************************/
+
+static struct json_object *jget(struct json_object *obj, const char *key)
+{
+	struct json_object *v;
+
+	return obj && json_object_object_get_ex(obj, key, &v) ? v : NULL;
+}
+
+static const char *jstr(struct json_object *obj, const char *key)
+{
+	struct json_object *v = jget(obj, key);
+
+	return v && json_object_is_type(v, json_type_string) ? json_object_get_string(v) : NULL;
+}
+
+/* gets the JSON object of 'url' from the Web API */
+static struct json_object *get_json(struct sync *sync, const char *url)
+{
+	struct json_object *obj;
+	char *result, *u;
+	CURL *curl;
+
+	obj = NULL;
+	/* the urls of the next pages are absolute */
+	u = replay_url(url);
+	curl = u ? curl_wrap_prepare_get_url(u) : NULL;
+	free(u);
+	if (curl) {
+		curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+		if (curl_wrap_add_header_value(curl, "Authorization", sync->auth)
+		 && curl_wrap_perform(curl, &result, NULL)) {
+			obj = json_tokener_parse(result);
+			free(result);
+			sync->pages++;
+		}
+		curl_easy_cleanup(curl);
+	}
+	return obj;
+}
+
+/*
+ * Adds to 'recs' the track described by 'track'. Returns 1 if added,
+ * 0 if skipped (local files, episodes...) or -1 on error.
+ */
+static int add_track(struct sync *sync, struct records *recs, struct json_object *track, const char *source)
+{
+	struct record rec;
+	struct json_object *artists;
+
+	rec.id = jstr(track, "id");
+	rec.name = jstr(track, "name");
+	if (!rec.id || !rec.name)
+		return 0; /* local files, episodes, ... */
+	artists = jget(track, "artists");
+	rec.artist = artists && json_object_array_length(artists)
+		? jstr(json_object_array_get_idx(artists, 0), "name") : NULL;
+	rec.album = jstr(jget(track, "album"), "name");
+	rec.id = sync_strdup(sync, rec.id);
+	rec.name = sync_strdup(sync, rec.name);
+	rec.artist = sync_strdup(sync, rec.artist);
+	rec.album = sync_strdup(sync, rec.album);
+	rec.source = source;
+	return rec.id && rec.name && records_add(recs, &rec) == 0 ? 1 : -1;
+}
+
+/*
+ * Fetches in 'recs' the saved tracks added after 'cursor' (or all if
+ * NULL). Returns in 'total' the count of saved items, in 'skipped' the
+ * count of the fetched items that aren't tracks and in 'newcursor' the
+ * time of the last addition.
+ */
+static int fetch_saved(struct sync *sync, struct records *recs, const char *cursor, int *total, int *skipped, const char **newcursor)
+{
+	struct json_object *obj, *items, *item;
+	const char *added, *next;
+	char *url;
+	size_t i, n;
+	int stop, rc;
+
+	*total = 0;
+	*skipped = 0;
+	*newcursor = NULL;
+	if (asprintf(&url, "%s/me/tracks?limit=50", webapi) < 0)
+		return -1;
+	for (stop = 0 ; url ; ) {
+		obj = get_json(sync, url);
+		free(url);
+		url = NULL;
+		if (!obj)
+			return -1;
+		*total = json_object_get_int(jget(obj, "total"));
+		items = jget(obj, "items");
+		n = items ? json_object_array_length(items) : 0;
+		for (i = 0 ; i < n && !stop ; i++) {
+			item = json_object_array_get_idx(items, i);
+			added = jstr(item, "added_at");
+			if (added && !*newcursor)
+				*newcursor = sync_strdup(sync, added);
+			if (cursor && added && strcmp(added, cursor) <= 0)
+				stop = 1;
+			else {
+				rc = add_track(sync, recs, jget(item, "track"), "saved");
+				if (rc < 0)
+					stop = -1;
+				else if (rc == 0)
+					++*skipped;
+			}
+		}
+		next = jstr(obj, "next");
+		if (!stop && next)
+			url = strdup(next);
+		json_object_put(obj);
+	}
+	return stop < 0 ? -1 : 0;
+}
+
+/* fetches in 'recs' the tracks of the playlist 'id' */
+static int fetch_playlist(struct sync *sync, struct records *recs, const char *id)
+{
+	struct json_object *obj, *items;
+	const char *next, *source;
+	char *url;
+	size_t i, n;
+	int rc;
+
+	source = sync_strdup(sync, id);
+	if (!source || asprintf(&url, "%s/playlists/%s/tracks?limit=100", webapi, id) < 0)
+		return -1;
+	for (rc = 0 ; url && rc >= 0 ; ) {
+		obj = get_json(sync, url);
+		free(url);
+		url = NULL;
+		if (!obj)
+			return -1;
+		items = jget(obj, "items");
+		n = items ? json_object_array_length(items) : 0;
+		for (i = 0 ; i < n && rc >= 0 ; i++)
+			rc = add_track(sync, recs, jget(json_object_array_get_idx(items, i), "track"), source);
+		next = jstr(obj, "next");
+		if (next)
+			url = strdup(next);
+		json_object_put(obj);
+	}
+	free(url);
+	return rc;
+}
+
+/* fetches in the array 'list' the id and snapshot of the playlists */
+static int fetch_playlists(struct sync *sync, struct json_object *list)
+{
+	struct json_object *obj, *items, *item, *pl;
+	const char *next, *id, *snapshot;
+	char *url;
+	size_t i, n;
+
+	if (asprintf(&url, "%s/me/playlists?limit=50", webapi) < 0)
+		return -1;
+	while (url) {
+		obj = get_json(sync, url);
+		free(url);
+		url = NULL;
+		if (!obj)
+			return -1;
+		items = jget(obj, "items");
+		n = items ? json_object_array_length(items) : 0;
+		for (i = 0 ; i < n ; i++) {
+			item = json_object_array_get_idx(items, i);
+			id = jstr(item, "id");
+			snapshot = jstr(item, "snapshot_id");
+			if (id && snapshot) {
+				pl = json_object_new_object();
+				json_object_object_add(pl, "id", json_object_new_string(id));
+				json_object_object_add(pl, "snapshot", json_object_new_string(snapshot));
+				json_object_array_add(list, pl);
+			}
+		}
+		next = jstr(obj, "next");
+		if (next)
+			url = strdup(next);
+		json_object_put(obj);
+	}
+	return 0;
+}
+
+/* returns the snapshot of the playlist 'id' in 'list' or NULL */
+static const char *snapshot_of(struct json_object *list, const char *id)
+{
+	struct json_object *pl;
+	size_t i, n;
+
+	n = list && json_object_is_type(list, json_type_array) ? json_object_array_length(list) : 0;
+	for (i = 0 ; i < n ; i++) {
+		pl = json_object_array_get_idx(list, i);
+		if (!strcmp(jstr(pl, "id") ?: "", id))
+			return jstr(pl, "snapshot");
+	}
+	return NULL;
+}
+
+/* is the playlist 'id' unchanged between 'oldlist' and 'newlist'? */
+static int unchanged(struct json_object *oldlist, struct json_object *newlist, const char *id)
+{
+	const char *o = snapshot_of(oldlist, id), *n = snapshot_of(newlist, id);
+
+	return o && n && !strcmp(o, n);
+}
+
+/* synchronises the index of the user of 'sync' */
+static int synchronise(struct sync *sync)
+{
+	struct json_object *state, *oldlist, *newlist, *pl;
+	struct records recs = { 0 }, saved = { 0 };
+	struct index old;
+	struct record rec;
+	const struct itrack *t;
+	const char *cursor, *newcursor, *id;
+	char *idxpath, *statepath, *bearer;
+	int rc, total, skipped, oldskipped, keepsaved;
+	size_t i, n, oldsaved;
+
+	rc = -1;
+	state = NULL;
+	newlist = json_object_new_array();
+	idxpath = statepath = NULL;
+	memset(&old, 0, sizeof old);
+
+	bearer = tokens_get(sync->user);
+	if (!bearer || asprintf(&sync->auth, "Bearer %s", bearer) < 0)
+		goto end;
+	if (asprintf(&idxpath, "%s/%s", root, sync->user) < 0)
+		goto end;
+	mkdir(root, 0755);
+	mkdir(idxpath, 0755);
+	free(idxpath);
+	if (asprintf(&idxpath, "%s/%s/library.idx", root, sync->user) < 0
+	 || asprintf(&statepath, "%s/%s/library.json", root, sync->user) < 0)
+		goto end;
+
+	/* the previous state, ignored without previous index */
+	if (index_map(&old, idxpath) == 0)
+		state = json_object_from_file(statepath);
+	cursor = jstr(state, "cursor");
+	oldskipped = json_object_get_int(jget(state, "skipped"));
+	oldlist = jget(state, "playlists");
+
+	/* the saved tracks added since the last synchronisation */
+	if (fetch_playlists(sync, newlist) < 0
+	 || fetch_saved(sync, &saved, cursor, &total, &skipped, &newcursor) < 0)
+		goto end;
+	keepsaved = cursor != NULL;
+	if (keepsaved) {
+		/*
+		 * removals aren't incremental, detect them with the count
+		 * that includes the saved items not indexed
+		 */
+		for (oldsaved = i = 0 ; old.base && i < old.header->ntracks ; i++)
+			oldsaved += !strcmp(ixstr(&old, old.tracks[i].source), "saved");
+		skipped += oldskipped;
+		if (oldsaved + saved.count + (size_t)skipped != (size_t)total) {
+			saved.count = 0;
+			keepsaved = 0;
+			if (fetch_saved(sync, &saved, NULL, &total, &skipped, &newcursor) < 0)
+				goto end;
+		}
+	}
+
+	/* the tracks kept from the previous index */
+	for (i = 0 ; old.base && i < old.header->ntracks ; i++) {
+		t = &old.tracks[i];
+		rec.source = ixstr(&old, t->source);
+		if (!strcmp(rec.source, "saved") ? keepsaved : unchanged(oldlist, newlist, rec.source)) {
+			rec.id = ixstr(&old, t->id);
+			rec.name = ixstr(&old, t->name);
+			rec.artist = ixstr(&old, t->artist);
+			rec.album = ixstr(&old, t->album);
+			if (records_add(&recs, &rec) < 0)
+				goto end;
+		}
+	}
+	for (i = 0 ; i < saved.count ; i++)
+		if (records_add(&recs, &saved.items[i]) < 0)
+			goto end;
+
+	/* the tracks of the changed playlists */
+	n = json_object_array_length(newlist);
+	for (i = 0 ; i < n ; i++) {
+		pl = json_object_array_get_idx(newlist, i);
+		id = jstr(pl, "id");
+		if (!unchanged(oldlist, newlist, id) && fetch_playlist(sync, &recs, id) < 0)
+			goto end;
+	}
+
+	/* record the new index and state */
+	if (index_write(idxpath, recs.items, recs.count) < 0)
+		goto end;
+	pl = json_object_new_object();
+	if (newcursor || cursor)
+		json_object_object_add(pl, "cursor", json_object_new_string(newcursor ?: cursor));
+	json_object_object_add(pl, "skipped", json_object_new_int(skipped));
+	json_object_object_add(pl, "playlists", json_object_get(newlist));
+	rc = json_object_to_file(statepath, pl) < 0 ? -1 : 0;
+	json_object_put(pl);
+end:
+	index_unmap(&old);
+	json_object_put(state);
+	json_object_put(newlist);
+	free(recs.items);
+	free(saved.items);
+	free(idxpath);
+	free(statepath);
+	free(bearer);
+	return rc;
+}
+
+/******************************************************************/
+/* interface                                                      */
+/******************************************************************/
+
+/*
+ * Initializes the library whose indexes are in 'root'/<user> and that
+ * are synchronised with the Web API at 'webapi'.
+ */
+int library_init(const char *lroot, const char *lwebapi)
+{
+	root = strdup(lroot);
+	webapi = strdup(lwebapi);
+	return root && webapi ? 0 : -1;
+}
+
+/* maps the index of 'user' as the active one, called with the write lock */
+static int open_index(const char *user)
+{
+	char *path;
+	int rc;
+
+	index_unmap(&active);
+	if (!user)
+		return 0;
+	if (asprintf(&path, "%s/%s/library.idx", root, user) < 0)
+		return -1;
+	rc = index_map(&active, path);
+	free(path);
+	return rc;
+}
+
+/* maps again the index of 'user' if it is the active user */
+static void reload(const char *user)
+{
+	pthread_rwlock_wrlock(&rwlock);
+	if (active_user && !strcmp(active_user, user))
+		open_index(user);
+	pthread_rwlock_unlock(&rwlock);
+}
+
+/* makes 'user' (or nobody if NULL) the active user whose index is searched */
+int library_open(const char *user)
+{
+	char *u;
+	int rc;
+
+	if (!root)
+		return -1;
+	u = user ? strdup(user) : NULL;
+	pthread_rwlock_wrlock(&rwlock);
+	free(active_user);
+	active_user = u;
+	rc = open_index(u);
+	pthread_rwlock_unlock(&rwlock);
+	return rc;
+}
+
+/*
+ * The thread of synchronisation of the user 'arg', then of the users
+ * requested meanwhile.
+ */
+static void *syncer(void *arg)
+{
+	struct sync sync;
+	struct block *b;
+	char *next;
+	long start;
+	int rc;
+
+	memset(&sync, 0, sizeof sync);
+	sync.user = arg;
+	while (sync.user) {
+		start = now_us();
+		rc = synchronise(&sync);
+
+		pthread_mutex_lock(&mutex);
+		if (rc < 0)
+			st.failures++;
+		else
+			st.syncs++;
+		st.duration = (now_us() - start) / 1000;
+		st.pages = sync.pages;
+		pthread_mutex_unlock(&mutex);
+
+		/* use the new index if it is the active user */
+		if (rc == 0)
+			reload(sync.user);
+
+		while ((b = sync.strings)) {
+			sync.strings = b->next;
+			free(b);
+		}
+		free(sync.auth);
+
+		/* the next user requested during the synchronisation */
+		pthread_mutex_lock(&mutex);
+		next = pending;
+		pending = NULL;
+		syncuser = next;
+		syncing = next != NULL;
+		pthread_mutex_unlock(&mutex);
+
+		free(sync.user);
+		memset(&sync, 0, sizeof sync);
+		sync.user = next;
+	}
+	return NULL;
+}
+
+/*
+ * Starts in background the synchronisation of the index of 'user'. If a
+ * synchronisation of another user is running, 'user' is synchronised
+ * after it.
+ */
+int library_sync(const char *user)
+{
+	pthread_t tid;
+	char *arg;
+	int rc;
+
+	if (!root || !user)
+		return -1;
+	pthread_mutex_lock(&mutex);
+	rc = 0;
+	if (syncing) {
+		free(pending);
+		pending = strcmp(syncuser, user) ? strdup(user) : NULL;
+	} else {
+		arg = strdup(user);
+		rc = arg && !pthread_create(&tid, NULL, syncer, arg) ? 0 : -1;
+		if (rc == 0) {
+			syncing = 1;
+			syncuser = arg;
+			pthread_detach(tid);
+		} else
+			free(arg);
+	}
+	pthread_mutex_unlock(&mutex);
+	return rc;
+}
+
+/* search state */
+struct search {
+	const struct index *ix;
+	uint16_t *marks;
+	uint16_t round;
+};
+
+/* marks the tracks having a token prefixed by 'query' */
+static int search_token(void *closure, const char *query)
+{
+	struct search *s = closure;
+	const struct itoken *tokens = s->ix->tokens;
+	uint32_t lo, hi, mid, i, end;
+	size_t len = strlen(query);
+	const uint32_t *p;
+
+	if (s->round >= QUERY_MAX)
+		return 0;
+
+	/* the first token not lower than the query */
+	lo = 0;
+	hi = s->ix->header->ntokens;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(ixstr(s->ix, tokens[mid].word), query) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* mark the tracks matching all the previous tokens and this one */
+	for (; lo < s->ix->header->ntokens && !strncmp(ixstr(s->ix, tokens[lo].word), query, len) ; lo++) {
+		p = &s->ix->postings[tokens[lo].first];
+		end = tokens[lo].count;
+		for (i = 0 ; i < end ; i++)
+			if (p[i] < s->ix->header->ntracks && s->marks[p[i]] == s->round)
+				s->marks[p[i]] = (uint16_t)(s->round + 1);
+	}
+	s->round++;
+	return 0;
+}
+
+/*
+ * Searches the tracks of the active user matching all the tokens of
+ * 'query', the tokens of the tracks being prefixed by those of the
+ * query. Returns an array of at most 'limit' tracks, RESULTS_MAX for
+ * a 'limit' out of range.
+ */
+struct json_object *library_search(const char *query, int limit)
+{
+	struct json_object *result, *item;
+	const struct itrack *t;
+	struct search s;
+	uint32_t i, n;
+	long start;
+
+	if (limit <= 0 || limit > RESULTS_MAX)
+		limit = RESULTS_MAX;
+	start = now_us();
+	result = json_object_new_array();
+	pthread_rwlock_rdlock(&rwlock);
+	s.ix = &active;
+	s.round = 0;
+	s.marks = active.base ? calloc(active.header->ntracks ?: 1, sizeof *s.marks) : NULL;
+	if (s.marks) {
+		tokenize(query, search_token, &s);
+		n = 0;
+		for (i = 0 ; s.round && i < active.header->ntracks && n < (uint32_t)limit ; i++) {
+			if (s.marks[i] != s.round)
+				continue;
+			t = &active.tracks[i];
+			/* skip the track already found in an other source */
+			if (s.marks[t->first] == FOUND)
+				continue;
+			s.marks[t->first] = FOUND;
+			item = json_object_new_object();
+			json_object_object_add(item, "id", json_object_new_string(ixstr(&active, t->id)));
+			json_object_object_add(item, "name", json_object_new_string(ixstr(&active, t->name)));
+			json_object_object_add(item, "artist", json_object_new_string(ixstr(&active, t->artist)));
+			json_object_object_add(item, "album", json_object_new_string(ixstr(&active, t->album)));
+			json_object_object_add(item, "source", json_object_new_string(ixstr(&active, t->source)));
+			json_object_array_add(result, item);
+			n++;
+		}
+		free(s.marks);
+	}
+	pthread_rwlock_unlock(&rwlock);
+
+	pthread_mutex_lock(&mutex);
+	st.queries++;
+	st.latency = now_us() - start;
+	st.total += st.latency;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+struct json_object *library_stats()
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	pthread_rwlock_rdlock(&rwlock);
+	json_object_object_add(result, "user", active_user ? json_object_new_string(active_user) : NULL);
+	json_object_object_add(result, "size", json_object_new_int64((int64_t)active.size));
+	json_object_object_add(result, "tracks", json_object_new_int64(active.base ? active.header->ntracks : 0));
+	json_object_object_add(result, "tokens", json_object_new_int64(active.base ? active.header->ntokens : 0));
+	pthread_rwlock_unlock(&rwlock);
+	pthread_mutex_lock(&mutex);
+	json_object_object_add(result, "syncing", json_object_new_boolean(syncing));
+	json_object_object_add(result, "syncs", json_object_new_int64(st.syncs));
+	json_object_object_add(result, "sync-failures", json_object_new_int64(st.failures));
+	json_object_object_add(result, "sync-duration", json_object_new_int64(st.duration));
+	json_object_object_add(result, "sync-pages", json_object_new_int64(st.pages));
+	json_object_object_add(result, "queries", json_object_new_int64(st.queries));
+	json_object_object_add(result, "query-latency", json_object_new_int64(st.latency));
+	json_object_object_add(result, "query-average", json_object_new_int64(st.queries ? st.total / st.queries : 0));
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */
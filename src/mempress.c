@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Management of the memory of the player.
+ *
+ * The player is placed in its own cgroup (v2) with configurable limits.
+ * The pressure stall information of that cgroup (or of the system when
+ * no cgroup is set) is watched and each notification of pressure moves
+ * one stage up, calling the handler of the stages. Without pressure, the
+ * stages are relaxed one by one. The memory used by the player is
+ * sampled periodically: the memory.current of the cgroup, that includes
+ * its page cache, or else the resident set of the player.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <json-c/json.h>
+
+#include "mempress.h"
+
+/* highest stage */
+#define MAX_STAGE	3
+
+/* minimal delay in seconds between two escalations */
+#define ESCALATE_DELAY	5
+
+/* delay in seconds without pressure before relaxing one stage */
+#define RELAX_DELAY	30
+
+/* window of the pressure trigger in microseconds */
+#define PSI_WINDOW	1000000
+
+/* period in seconds of the samples of memory */
+#define SAMPLE_PERIOD	10
+
+/* count of samples of memory kept */
+#define SAMPLES		60
+
+static char *cgroup;
+static char *procs;
+static long long high_limit;
+static int tightened;
+static int psifd = -1;
+static pid_t player;
+static void (*onstage)(int stage);
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	int stage;		/* current stage */
+	int maxstage;		/* highest stage reached */
+	unsigned events;	/* count of pressure notifications */
+	unsigned escalations;	/* count of escalations */
+	time_t last;		/* time of the last change or pressure */
+} st;
+static struct {
+	time_t time;
+	long long used;
+} samples[SAMPLES];
+static unsigned nsamples;
+
+static int write_file(const char *dir, const char *name, const char *value)
+{
+	char *path;
+	int fd, rc;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return -1;
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return -1;
+	rc = write(fd, value, strlen(value)) < 0 ? -1 : 0;
+	close(fd);
+	return rc;
+}
+
+/*
+ * Reads the value of 'key' in the file 'dir'/'name' made of lines
+ * "key value", or its first value if 'key' is NULL. Returns -1 on error.
+ */
+static long long read_value(const char *dir, const char *name, const char *key)
+{
+	char *path, line[256];
+	long long value;
+	size_t len;
+	FILE *f;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return -1;
+	f = fopen(path, "re");
+	free(path);
+	if (!f)
+		return -1;
+	value = -1;
+	len = key ? strlen(key) : 0;
+	while (value < 0 && fgets(line, sizeof line, f))
+		if (!key)
+			value = atoll(line);
+		else if (!strncmp(line, key, len) && (line[len] == ' ' || line[len] == '\t'))
+			value = atoll(&line[len + 1]);
+	fclose(f);
+	return value;
+}
+
+static int set_limit(const char *name, long long value)
+{
+	char buffer[32];
+
+	if (value <= 0)
+		return 0;
+	snprintf(buffer, sizeof buffer, "%lld", value);
+	return write_file(cgroup, name, buffer);
+}
+
+/* returns the memory used by the player in bytes */
+static long long memory_used()
+{
+	char *dir;
+	long long kb;
+
+	if (cgroup)
+		return read_value(cgroup, "memory.current", NULL);
+	if (!player || asprintf(&dir, "/proc/%d", (int)player) < 0)
+		return -1;
+	kb = read_value(dir, "status", "VmRSS:");
+	free(dir);
+	return kb < 0 ? -1 : kb * 1024;
+}
+
+/* changes the stage to 'stage' */
+static void set_stage(int stage, time_t now)
+{
+	pthread_mutex_lock(&mutex);
+	if (stage > st.stage)
+		st.escalations++;
+	st.stage = stage;
+	if (stage > st.maxstage)
+		st.maxstage = stage;
+	st.last = now;
+	pthread_mutex_unlock(&mutex);
+	if (onstage)
+		onstage(stage);
+}
+
+/* the thread watching the pressure */
+static void *watcher(void *arg)
+{
+	struct pollfd pfd;
+	time_t now, sampled;
+	long long used;
+	int rc;
+
+	pfd.fd = psifd;
+	pfd.events = POLLPRI;
+	sampled = 0;
+	for (;;) {
+		rc = poll(&pfd, 1, 1000);
+		if (rc < 0 && errno != EINTR)
+			break;
+		now = time(NULL);
+		if (rc > 0 && (pfd.revents & POLLERR)) {
+			/* the cgroup vanished, continue sampling */
+			pfd.fd = -1;
+		} else if (rc > 0 && (pfd.revents & POLLPRI)) {
+			pthread_mutex_lock(&mutex);
+			st.events++;
+			pthread_mutex_unlock(&mutex);
+			if (st.stage < MAX_STAGE && now - st.last >= ESCALATE_DELAY)
+				set_stage(st.stage + 1, now);
+			else
+				st.last = now; /* delays the relaxing */
+		} else if (st.stage > 0 && now - st.last >= RELAX_DELAY)
+			set_stage(st.stage - 1, now);
+
+		if (now - sampled >= SAMPLE_PERIOD) {
+			sampled = now;
+			used = memory_used();
+			if (used >= 0) {
+				pthread_mutex_lock(&mutex);
+				samples[nsamples % SAMPLES].time = now;
+				samples[nsamples % SAMPLES].used = used;
+				nsamples++;
+				pthread_mutex_unlock(&mutex);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Starts the management of the memory of the player. When 'cgroup' isn't
+ * NULL, it is the directory of the cgroup of the player that is limited
+ * by 'high' and 'max' bytes (0 for no limit). When 'stall' isn't 0, a
+ * pressure is notified when the tasks stall more than 'stall' ms per
+ * second and the function 'onstage' receives the new stages.
+ * Returns 0 on success or -1 if some of the settings failed.
+ */
+int mempress_init(const char *cg, long long high, long long max, int stall, void (*handler)(int stage))
+{
+	char *path, trigger[64];
+	pthread_t tid;
+	int rc;
+
+	rc = 0;
+	onstage = handler;
+	high_limit = high;
+	if (cg) {
+		cgroup = strdup(cg);
+		if (!cgroup || asprintf(&procs, "%s/cgroup.procs", cgroup) < 0)
+			return -1;
+		if (mkdir(cgroup, 0755) < 0 && errno != EEXIST) {
+			free(procs);
+			procs = NULL;
+			rc = -1;
+		} else if (set_limit("memory.high", high) < 0
+			|| set_limit("memory.max", max) < 0)
+			rc = -1;
+	}
+
+	if (stall > 0) {
+		if (!cgroup)
+			path = strdup("/proc/pressure/memory");
+		else if (asprintf(&path, "%s/memory.pressure", cgroup) < 0)
+			path = NULL;
+		psifd = path ? open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC) : -1;
+		snprintf(trigger, sizeof trigger, "some %d %d", stall * 1000, PSI_WINDOW);
+		if (psifd >= 0 && write(psifd, trigger, strlen(trigger) + 1) < 0) {
+			close(psifd);
+			psifd = -1;
+		}
+		if (psifd < 0)
+			rc = -1;
+		free(path);
+	}
+
+	if (pthread_create(&tid, NULL, watcher, NULL))
+		return -1;
+	pthread_detach(tid);
+	return rc;
+}
+
+/* moves the calling process in the cgroup, called by the forked player */
+void mempress_enter()
+{
+	int fd;
+
+	if (procs) {
+		fd = open(procs, O_WRONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			/* on failure, stays in the cgroup of the binder */
+			while (write(fd, "0", 1) < 0 && errno == EINTR);
+			close(fd);
+		}
+	}
+}
+
+/* records the pid of the player */
+void mempress_player(pid_t pid)
+{
+	player = pid;
+}
+
+/*
+ * Lowers ('tighten' not null) the memory.high of the cgroup to 7/8 of the
+ * memory used, or of its limit if lower, making the kernel reclaim the
+ * memory of the player, or restores it.
+ */
+void mempress_tighten(int tighten)
+{
+	char buffer[32];
+	long long limit;
+
+	if (!cgroup || tighten == tightened)
+		return;
+	if (tighten) {
+		limit = read_value(cgroup, "memory.current", NULL);
+		if (limit <= 0)
+			return;
+		if (high_limit > 0 && high_limit < limit)
+			limit = high_limit;
+		snprintf(buffer, sizeof buffer, "%lld", limit - limit / 8);
+	} else if (high_limit > 0)
+		snprintf(buffer, sizeof buffer, "%lld", high_limit);
+	else
+		strcpy(buffer, "max");
+	if (write_file(cgroup, "memory.high", buffer) == 0)
+		tightened = tighten;
+}
+
+struct json_object *mempress_stats()
+{
+	struct json_object *result, *array, *item;
+	unsigned i, n;
+
+	result = json_object_new_object();
+	if (cgroup) {
+		json_object_object_add(result, "cgroup", json_object_new_string(cgroup));
+		json_object_object_add(result, "high", json_object_new_int64(read_value(cgroup, "memory.events", "high")));
+		json_object_object_add(result, "max", json_object_new_int64(read_value(cgroup, "memory.events", "max")));
+		json_object_object_add(result, "oom-kill", json_object_new_int64(read_value(cgroup, "memory.events", "oom_kill")));
+		json_object_object_add(result, "tightened", json_object_new_boolean(tightened));
+	}
+	array = json_object_new_array();
+	pthread_mutex_lock(&mutex);
+	json_object_object_add(result, "stage", json_object_new_int(st.stage));
+	json_object_object_add(result, "max-stage", json_object_new_int(st.maxstage));
+	json_object_object_add(result, "pressures", json_object_new_int64(st.events));
+	json_object_object_add(result, "escalations", json_object_new_int64(st.escalations));
+	n = nsamples < SAMPLES ? nsamples : SAMPLES;
+	for (i = nsamples - n ; i < nsamples ; i++) {
+		item = json_object_new_object();
+		json_object_object_add(item, "time", json_object_new_int64(samples[i % SAMPLES].time));
+		json_object_object_add(item, "used", json_object_new_int64(samples[i % SAMPLES].used));
+		json_object_array_add(array, item);
+	}
+	pthread_mutex_unlock(&mutex);
+	json_object_object_add(result, "memory", array);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */
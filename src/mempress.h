@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <sys/types.h>
+
+struct json_object;
+
+extern int mempress_init(const char *cgroup, long long high, long long max, int stall, void (*onstage)(int stage));
+extern void mempress_enter();
+extern void mempress_player(pid_t pid);
+extern void mempress_tighten(int tighten);
+extern struct json_object *mempress_stats();
+
+/* vim: set colorcolumn=80: */
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Routing of the PCM samples of the player to the audio sink.
+ *
+ * The player writes its raw samples in a pipe owned by the binding. A
+ * thread moves them from the pipe to the sink with splice, so the
+ * samples never cross the user space of the binding. The depth of the
+ * pipe, the underruns and the latency of each play are measured: from
+ * the request of a track to the first sample after the pipe was idle.
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include <json-c/json.h>
+
+#include "pcm.h"
+
+/* default size of the pipes on linux */
+#define DEFAULT_SIZE	65536
+
+/* size of the pipe when shrunk under memory pressure */
+#define SHRUNK_SIZE	16384
+
+/* maximum count of bytes moved at once */
+#define CHUNK		65536
+
+/* empty pipe delay in ms after which an underrun is counted */
+#define XRUN_DELAY	20
+
+/* empty pipe delay in ms after which the player is considered paused */
+#define PAUSE_DELAY	1000
+
+static char *sink;
+static int bufsize;
+static int wrfd = -1;
+static int rdfd = -1;
+static int shrunk;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	int running;		/* is the pump running? */
+	int pipefd;		/* read end of the pipe of the last pump */
+	int armed;		/* is a play waiting for its first sample? */
+	long mark;		/* time in ms of the request of the play */
+	unsigned plays;		/* count of plays measured */
+	long latency;		/* last latency in ms to the first sample */
+	long minlat;		/* minimal latency to the first sample */
+	long maxlat;		/* maximal latency to the first sample */
+	int depth;		/* last depth of the pipe in bytes */
+	int maxdepth;		/* maximal depth of the pipe in bytes */
+	unsigned xruns;		/* count of underruns */
+	unsigned long long bytes; /* count of bytes moved */
+	unsigned copies;	/* count of fallbacks to copies */
+} st = { .pipefd = -1 };
+
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* moves 'len' bytes from 'in' to 'out' by copy when splice can't */
+static ssize_t copy(int in, int out, size_t len)
+{
+	char buffer[4096];
+	ssize_t rc, wr, off;
+
+	rc = read(in, buffer, len < sizeof buffer ? len : sizeof buffer);
+	for (off = 0 ; off < rc ; off += wr) {
+		wr = write(out, &buffer[off], (size_t)(rc - off));
+		if (wr < 0)
+			return wr;
+	}
+	return rc;
+}
+
+/* the thread moving the samples from the pipe 'arg' to the sink */
+static void *pump(void *arg)
+{
+	struct pollfd pfd;
+	int in, out, depth, first, idle, usecopy;
+	long empty, now, gap;
+	ssize_t rc;
+
+	in = (int)(intptr_t)arg;
+	out = open(sink, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	first = 1;
+	idle = 1;
+	usecopy = 0;
+	empty = 0;
+	pfd.fd = in;
+	pfd.events = POLLIN;
+	while (out >= 0) {
+		rc = poll(&pfd, 1, XRUN_DELAY);
+		if (rc < 0 && errno != EINTR)
+			break;
+		if (rc <= 0) {
+			if (!empty && !first)
+				empty = now_ms() - XRUN_DELAY;
+			else if (empty && now_ms() - empty >= PAUSE_DELAY)
+				idle = 1;
+			continue;
+		}
+
+		/* measure the depth and the underruns */
+		now = now_ms();
+		if (ioctl(in, FIONREAD, &depth) < 0)
+			depth = 0;
+		pthread_mutex_lock(&mutex);
+		st.depth = depth;
+		if (depth > st.maxdepth)
+			st.maxdepth = depth;
+		if (st.armed && idle && depth) {
+			st.latency = now - st.mark;
+			if (!st.plays++ || st.latency < st.minlat)
+				st.minlat = st.latency;
+			if (st.latency > st.maxlat)
+				st.maxlat = st.latency;
+		}
+		/* a play requested while playing has no latency */
+		st.armed = 0;
+		if (empty) {
+			gap = now - empty;
+			if (gap >= XRUN_DELAY && gap < PAUSE_DELAY)
+				st.xruns++;
+		}
+		pthread_mutex_unlock(&mutex);
+		first = 0;
+		idle = 0;
+		empty = 0;
+
+		/* move the samples */
+		rc = -1;
+		if (!usecopy) {
+			rc = splice(in, NULL, out, NULL, CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+			usecopy = rc < 0 && errno == EINVAL;
+		}
+		if (usecopy) {
+			rc = copy(in, out, CHUNK);
+			pthread_mutex_lock(&mutex);
+			st.copies++;
+			pthread_mutex_unlock(&mutex);
+		}
+		if (rc <= 0 && !(rc < 0 && (errno == EINTR || errno == EAGAIN)))
+			break;
+		if (rc > 0) {
+			pthread_mutex_lock(&mutex);
+			st.bytes += (unsigned long long)rc;
+			pthread_mutex_unlock(&mutex);
+		}
+	}
+
+	if (out >= 0)
+		close(out);
+	pthread_mutex_lock(&mutex);
+	if (st.pipefd == in)
+		st.pipefd = -1;
+	close(in);
+	st.running--;
+	st.depth = 0;
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/*
+ * Enables the routing of the PCM samples to 'sink' through a pipe of
+ * 'bufsize' bytes (0 for the system default).
+ */
+int pcm_init(const char *psink, int pbufsize)
+{
+	sink = strdup(psink);
+	bufsize = pbufsize;
+	return sink ? 0 : -1;
+}
+
+/*
+ * Creates the pipe for a player about to start. Returns the file
+ * descriptor that the player writes or -1 if the routing is disabled.
+ * Must be followed by a call to pcm_started.
+ */
+int pcm_open()
+{
+	int fds[2];
+
+	if (!sink || pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	if (shrunk)
+		fcntl(fds[1], F_SETPIPE_SZ, SHRUNK_SIZE);
+	else if (bufsize > 0)
+		fcntl(fds[1], F_SETPIPE_SZ, bufsize);
+	rdfd = fds[0];
+	wrfd = fds[1];
+	return wrfd;
+}
+
+/*
+ * Tells whether the player started ('ok' not null) or not. When started,
+ * its samples are routed to the sink until it closes the pipe.
+ */
+void pcm_started(int ok)
+{
+	pthread_t tid;
+
+	if (wrfd < 0)
+		return;
+	close(wrfd);
+	wrfd = -1;
+	pthread_mutex_lock(&mutex);
+	st.armed = 0;
+	if (ok && !pthread_create(&tid, NULL, pump, (void*)(intptr_t)rdfd)) {
+		pthread_detach(tid);
+		st.running++;
+		st.pipefd = rdfd;
+	} else
+		close(rdfd);
+	rdfd = -1;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Marks the request of a play by the player: its latency is the delay
+ * to its first sample if the pipe was idle.
+ */
+void pcm_play()
+{
+	pthread_mutex_lock(&mutex);
+	st.mark = now_ms();
+	st.armed = 1;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Shrinks ('shrink' not null) or restores the size of the pipe. The
+ * shrinking reduces the samples that the player prefetches.
+ */
+void pcm_shrink(int shrink)
+{
+	pthread_mutex_lock(&mutex);
+	shrunk = shrink;
+	if (st.pipefd >= 0)
+		fcntl(st.pipefd, F_SETPIPE_SZ, shrink ? SHRUNK_SIZE : bufsize > 0 ? bufsize : DEFAULT_SIZE);
+	pthread_mutex_unlock(&mutex);
+}
+
+struct json_object *pcm_stats()
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	pthread_mutex_lock(&mutex);
+	json_object_object_add(result, "sink", sink ? json_object_new_string(sink) : NULL);
+	json_object_object_add(result, "running", json_object_new_boolean(st.running > 0));
+	json_object_object_add(result, "buffer", json_object_new_int(bufsize));
+	json_object_object_add(result, "shrunk", json_object_new_boolean(shrunk));
+	json_object_object_add(result, "depth", json_object_new_int(st.depth));
+	json_object_object_add(result, "max-depth", json_object_new_int(st.maxdepth));
+	json_object_object_add(result, "bytes", json_object_new_int64((int64_t)st.bytes));
+	json_object_object_add(result, "xruns", json_object_new_int64(st.xruns));
+	json_object_object_add(result, "copies", json_object_new_int64(st.copies));
+	json_object_object_add(result, "plays", json_object_new_int64(st.plays));
+	json_object_object_add(result, "latency", json_object_new_int64(st.latency));
+	json_object_object_add(result, "min-latency", json_object_new_int64(st.minlat));
+	json_object_object_add(result, "max-latency", json_object_new_int64(st.maxlat));
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */
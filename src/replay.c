@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Record and replay of the HTTP transfers.
+ *
+ * When recording, each transfer completed by curl-wrap is appended to a
+ * file with its start time, its duration, its HTTP status, its URL, its
+ * content type and its decoded content:
+ *
+ *   SPREC1\n
+ *   <start ms> <duration ms> <status> <url len> <type len> <body len>\n
+ *   <url><type><body>\n
+ *   ...
+ *
+ * When replaying, a server listening on the loopback answers the
+ * requests whose path and query match a recorded URL with the recorded
+ * response, after the recorded duration scaled by a percentage. The
+ * responses of a same URL are given in the recorded order, the last one
+ * being repeated. A status 0 records a transfer without response: the
+ * connection is closed.
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <curl/curl.h>
+#include <json-c/json.h>
+
+#include "curl-wrap.h"
+#include "replay.h"
+
+#define MAGIC		"SPREC1\n"
+
+/* maximum size of the head of a request */
+#define HEAD_MAX	8192
+
+/* a recorded transfer */
+struct record {
+	char *path;		/* path and query of the URL */
+	char *type;		/* content type or NULL */
+	char *body;
+	size_t size;		/* size of the body */
+	long duration;		/* duration in ms */
+	int status;		/* HTTP status or 0 */
+	int served;
+};
+
+/* recording */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *recfile;
+static long origin;
+
+/* replaying */
+static struct record *records;
+static int nrecords;
+static int scale;
+static int port;
+static struct {
+	unsigned served;	/* count of recorded responses served */
+	unsigned repeated;	/* count of responses served again */
+	unsigned missed;	/* count of requests not recorded */
+	unsigned recorded;	/* count of transfers recorded */
+} st;
+
+/* returns the current monotonic time in milliseconds */
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* returns the path and query of 'url' */
+static const char *path_of(const char *url)
+{
+	const char *p;
+
+	p = strstr(url, "://");
+	p = p ? p + 3 : url;
+	p += strcspn(p, "/?");
+	return *p ? p : "/";
+}
+
+/* observer of curl-wrap appending the transfers to the record file */
+static void record(CURL *curl, int ok, const char *data, size_t size)
+{
+	char *url, *type;
+	long status, end;
+	double total;
+
+	end = now_ms();
+	url = type = NULL;
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &type);
+	if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK)
+		status = 0;
+	if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total) != CURLE_OK)
+		total = 0;
+	if (!url)
+		return;
+	if (!type)
+		type = "";
+	if (!data)
+		size = 0;
+
+	pthread_mutex_lock(&mutex);
+	if (recfile) {
+		fprintf(recfile, "%ld %ld %ld %zu %zu %zu\n",
+			end - origin - (long)(total * 1000), (long)(total * 1000),
+			status, strlen(url), strlen(type), size);
+		fputs(url, recfile);
+		fputs(type, recfile);
+		fwrite(data ?: "", 1, size, recfile);
+		fputc('\n', recfile);
+		fflush(recfile);
+		st.recorded++;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/* starts recording the transfers in the file of 'path' */
+int replay_record(const char *path)
+{
+	FILE *file;
+	int fd;
+
+	/* private, the responses of the token service hold bearers */
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	file = fdopen(fd, "w");
+	if (!file) {
+		close(fd);
+		return -1;
+	}
+	fputs(MAGIC, file);
+	pthread_mutex_lock(&mutex);
+	if (recfile)
+		fclose(recfile);
+	recfile = file;
+	origin = now_ms();
+	pthread_mutex_unlock(&mutex);
+	curl_wrap_set_observer(record);
+	return 0;
+}
+
+/* returns a copy of the 'length' bytes of 'data' or NULL */
+static char *copy(const char *data, size_t length)
+{
+	char *result;
+
+	result = malloc(length + 1);
+	if (result) {
+		memcpy(result, data, length);
+		result[length] = 0;
+	}
+	return result;
+}
+
+/*
+ * Reads the 'count' numbers of the line 'p' ending at 'eol' in 'values'.
+ * Returns 0 on success or -1 if the line is invalid.
+ */
+static int numbers(const char *p, const char *eol, long long *values, int count)
+{
+	char *q;
+	int i;
+
+	for (i = 0 ; i < count ; i++) {
+		values[i] = strtoll(p, &q, 10);
+		if (q == p || q > eol || values[i] < 0)
+			return -1;
+		p = q;
+	}
+	return p == eol ? 0 : -1;
+}
+
+/* reads the records of the file of 'path' */
+static int load(const char *path)
+{
+	FILE *file;
+	char *data, *p, *eol, *end, *url;
+	struct record *r;
+	size_t size, lurl, ltype, lbody, left;
+	long long v[6];
+	int n;
+
+	/* read the whole file */
+	file = fopen(path, "re");
+	if (!file)
+		return -1;
+	data = NULL;
+	size = 0;
+	if (fseek(file, 0, SEEK_END) == 0 && (n = (int)ftell(file)) >= 0
+	 && fseek(file, 0, SEEK_SET) == 0 && (data = malloc((size_t)n + 1))
+	 && fread(data, 1, (size_t)n, file) == (size_t)n)
+		size = (size_t)n;
+	fclose(file);
+	if (size < sizeof MAGIC - 1 || memcmp(data, MAGIC, sizeof MAGIC - 1)) {
+		free(data);
+		return -1;
+	}
+	data[size] = 0;
+
+	/* parse it */
+	p = data + sizeof MAGIC - 1;
+	end = data + size;
+	while (p < end) {
+		/* the header "start duration status urllen typelen bodylen" */
+		eol = memchr(p, '\n', (size_t)(end - p));
+		if (!eol || numbers(p, eol, v, 6) < 0)
+			break;
+		left = (size_t)(end - eol - 1);
+		lurl = (size_t)v[3];
+		ltype = (size_t)v[4];
+		lbody = (size_t)v[5];
+		if (lurl > left || ltype > left - lurl
+		 || lbody >= left - lurl - ltype)
+			break;
+		r = realloc(records, (size_t)(nrecords + 1) * sizeof *records);
+		if (!r)
+			break;
+		records = r;
+		r = &records[nrecords];
+		p = eol + 1;
+		url = copy(p, lurl);
+		r->path = url ? strdup(path_of(url)) : NULL;
+		free(url);
+		r->type = ltype ? copy(p + lurl, ltype) : NULL;
+		r->body = copy(p + lurl + ltype, lbody);
+		r->size = lbody;
+		r->duration = (long)v[1];
+		r->status = (int)v[2];
+		r->served = 0;
+		p += lurl + ltype + lbody + 1;
+		if (r->path && r->body)
+			nrecords++;
+		else {
+			free(r->path);
+			free(r->type);
+			free(r->body);
+		}
+	}
+	free(data);
+	return 0;
+}
+
+/* returns the record to serve for 'path' or NULL */
+static struct record *match(const char *path)
+{
+	struct record *r, *last;
+	int i;
+
+	last = NULL;
+	pthread_mutex_lock(&mutex);
+	for (i = 0 ; i < nrecords ; i++) {
+		r = &records[i];
+		if (strcmp(r->path, path))
+			continue;
+		if (!r->served) {
+			r->served = 1;
+			st.served++;
+			pthread_mutex_unlock(&mutex);
+			return r;
+		}
+		last = r;
+	}
+	if (last)
+		st.repeated++;
+	else
+		st.missed++;
+	pthread_mutex_unlock(&mutex);
+	return last;
+}
+
+/* writes the 'size' bytes of 'data' to 'fd' */
+static int write_all(int fd, const char *data, size_t size)
+{
+	ssize_t rc;
+
+	while (size) {
+		rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		size -= (size_t)rc;
+	}
+	return 0;
+}
+
+/* serves the request of the connection 'arg' */
+static void *serve(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char head[HEAD_MAX + 1], body[4096], *target, *eoh, *hdr;
+	struct record *r;
+	size_t length;
+	ssize_t rc;
+	long clen;
+	int n;
+
+	/* read the head of the request */
+	length = 0;
+	eoh = NULL;
+	while (!eoh && length < HEAD_MAX) {
+		rc = read(fd, &head[length], HEAD_MAX - length);
+		if (rc <= 0)
+			goto end;
+		length += (size_t)rc;
+		head[length] = 0;
+		eoh = strstr(head, "\r\n\r\n");
+	}
+	if (!eoh)
+		goto end;
+
+	/* get the target of "METHOD target HTTP/1.x" */
+	hdr = strcasestr(head, "\r\ncontent-length:");
+	clen = hdr && hdr < eoh ? strtol(hdr + 17, NULL, 10) : 0;
+	clen -= (long)(&head[length] - (eoh + 4));
+	target = strchr(head, ' ');
+	if (!target)
+		goto end;
+	target++;
+	target[strcspn(target, " \r")] = 0;
+
+	/* drain the body of the request, the head being kept */
+	while (clen > 0 && (rc = read(fd, body, sizeof body)) > 0)
+		clen -= rc;
+
+	r = match(target);
+	if (!r) {
+		dprintf(fd, "HTTP/1.1 404 Not Recorded\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n");
+		goto end;
+	}
+	if (scale > 0 && r->duration > 0)
+		usleep((useconds_t)(r->duration * scale / 100) * 1000);
+	if (r->status) {
+		n = dprintf(fd, "HTTP/1.1 %d Replayed\r\n%s%s%s"
+			"Content-Length: %zu\r\nConnection: close\r\n\r\n",
+			r->status, r->type ? "Content-Type: " : "",
+			r->type ?: "", r->type ? "\r\n" : "", r->size);
+		if (n > 0)
+			write_all(fd, r->body, r->size);
+	}
+end:
+	close(fd);
+	return NULL;
+}
+
+/* the thread accepting the connections of the socket 'arg' */
+static void *listener(void *arg)
+{
+	int sock = (int)(intptr_t)arg, fd;
+	pthread_t tid;
+
+	for (;;) {
+		fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			usleep(100000);
+			continue;
+		}
+		/* one thread per connection for overlapping the delays */
+		if (pthread_create(&tid, NULL, serve, (void*)(intptr_t)fd))
+			close(fd);
+		else
+			pthread_detach(tid);
+	}
+	return NULL;
+}
+
+/*
+ * Starts serving the records of the file of 'path' on the loopback with
+ * the durations scaled by 'percent' (100 for the recorded speed, 0 for
+ * no delay). Returns the port of the server or -1 on error.
+ */
+int replay_serve(const char *path, int percent)
+{
+	struct sockaddr_in addr;
+	socklen_t len;
+	pthread_t tid;
+	int sock;
+
+	if (load(path) < 0)
+		return -1;
+	scale = percent;
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof addr;
+	if (bind(sock, (struct sockaddr*)&addr, len) < 0
+	 || listen(sock, 16) < 0
+	 || getsockname(sock, (struct sockaddr*)&addr, &len) < 0
+	 || pthread_create(&tid, NULL, listener, (void*)(intptr_t)sock)) {
+		close(sock);
+		return -1;
+	}
+	pthread_detach(tid);
+	port = ntohs(addr.sin_port);
+	return port;
+}
+
+/*
+ * Returns a copy of 'url' that must be freed, targeting the replay
+ * server when it runs.
+ */
+char *replay_url(const char *url)
+{
+	char *result;
+
+	if (!port)
+		return strdup(url);
+	if (asprintf(&result, "http://127.0.0.1:%d%s", port,
+			strcmp(path_of(url), "/") ? path_of(url) : "") < 0)
+		return NULL;
+	return result;
+}
+
+struct json_object *replay_stats()
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	pthread_mutex_lock(&mutex);
+	json_object_object_add(result, "recording", json_object_new_boolean(recfile != NULL));
+	json_object_object_add(result, "recorded", json_object_new_int64(st.recorded));
+	json_object_object_add(result, "port", json_object_new_int(port));
+	json_object_object_add(result, "records", json_object_new_int(nrecords));
+	json_object_object_add(result, "served", json_object_new_int64(st.served));
+	json_object_object_add(result, "repeated", json_object_new_int64(st.repeated));
+	json_object_object_add(result, "missed", json_object_new_int64(st.missed));
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */
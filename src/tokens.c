@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Cache of the bearer tokens of the users.
+ *
+ * The tokens are recorded by uid in an open addressing hash table with
+ * linear probing. Its count of entries is bounded, the least recently
+ * used entry being evicted when full. A thread renews the tokens of the
+ * recently used entries before they expire.
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <json-c/json.h>
+
+#include "endpoints.h"
+#include "escape.h"
+#include "tokens.h"
+
+/* delay in seconds before the expiration when the token is renewed */
+#define RENEW_MARGIN	60
+
+/* delay in seconds before retrying a failed renewal */
+#define RETRY_DELAY	30
+
+/* an entry not used since that delay in seconds isn't renewed */
+#define RENEW_IDLE	3600
+
+/* an entry of the table */
+struct token {
+	char *uid;		/* the uid or NULL when the slot is free */
+	char *bearer;		/* the bearer token */
+	uint32_t hash;		/* hash of the uid */
+	time_t expire;		/* time of expiration of the bearer */
+	time_t renew;		/* time of the renewal of the bearer */
+	time_t used;		/* time of the last use */
+};
+
+static struct token *table;
+static unsigned mask;		/* capacity - 1, capacity being a power of 2 */
+static unsigned count;
+static unsigned maxcount;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct {
+	unsigned hits;		/* count of valid tokens found */
+	unsigned misses;	/* count of tokens fetched on demand */
+	unsigned renewals;	/* count of tokens renewed in background */
+	unsigned failures;	/* count of failed fetches */
+	unsigned evictions;	/* count of entries evicted */
+} st;
+
+/* FNV-1a hash of 'uid' */
+static uint32_t hash_of(const char *uid)
+{
+	uint32_t h = 2166136261u;
+
+	while (*uid)
+		h = (h ^ (uint8_t)*uid++) * 16777619u;
+	return h;
+}
+
+/* returns the slot of 'uid' or NULL */
+static struct token *search(const char *uid, uint32_t hash)
+{
+	unsigned i;
+	struct token *t;
+
+	if (!table)
+		return NULL;
+	for (i = hash & mask ; (t = &table[i])->uid ; i = (i + 1) & mask)
+		if (t->hash == hash && !strcmp(t->uid, uid))
+			return t;
+	return NULL;
+}
+
+/* removes the entry 't' by shifting back the entries that follow it */
+static void remove_slot(struct token *t)
+{
+	unsigned hole, i, home;
+
+	free(t->uid);
+	free(t->bearer);
+	hole = (unsigned)(t - table);
+	for (i = (hole + 1) & mask ; table[i].uid ; i = (i + 1) & mask) {
+		home = table[i].hash & mask;
+		/* moves the entry if its home isn't in ]hole, i] */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			table[hole] = table[i];
+			hole = i;
+		}
+	}
+	table[hole].uid = NULL;
+	table[hole].bearer = NULL;
+	count--;
+}
+
+static void evict_lru()
+{
+	struct token *t, *lru;
+	unsigned i;
+
+	lru = NULL;
+	for (i = 0 ; i <= mask ; i++) {
+		t = &table[i];
+		if (t->uid && (!lru || t->used < lru->used))
+			lru = t;
+	}
+	if (lru) {
+		remove_slot(lru);
+		st.evictions++;
+	}
+}
+
+/* records the 'bearer' of 'uid' expiring in 'expires' seconds */
+static struct token *store(const char *uid, char *bearer, int expires, time_t now)
+{
+	struct token *t;
+	uint32_t hash;
+	unsigned i;
+
+	hash = hash_of(uid);
+	t = search(uid, hash);
+	if (!t) {
+		if (count >= maxcount)
+			evict_lru();
+		for (i = hash & mask ; table[i].uid ; i = (i + 1) & mask);
+		t = &table[i];
+		t->uid = strdup(uid);
+		if (!t->uid) {
+			free(bearer);
+			return NULL;
+		}
+		t->hash = hash;
+		t->bearer = NULL;
+		t->used = now;
+		count++;
+	}
+	free(t->bearer);
+	t->bearer = bearer;
+	t->expire = now + expires;
+	t->renew = t->expire - (expires > RENEW_MARGIN ? RENEW_MARGIN : 0);
+	pthread_cond_signal(&cond);
+	return t;
+}
+
+/* fetches the bearer of 'uid' from the token service */
+static int fetch(const char *uid, char **bearer, int *expires)
+{
+	const char *args[] = { "uid", uid, NULL };
+	char *path, *result;
+	struct json_object *data, *v;
+	int rc;
+
+	*bearer = NULL;
+	path = escape_url(NULL, "/spotify/token", args, NULL);
+	if (!path)
+		return 0;
+	rc = endpoints_get(path, &result, NULL);
+	free(path);
+	if (!rc)
+		return 0;
+	data = json_tokener_parse(result);
+	free(result);
+	if (!data)
+		return 0;
+	if (json_object_object_get_ex(data, "access_token", &v))
+		*bearer = strdup(json_object_get_string(v));
+	*expires = json_object_object_get_ex(data, "expires_in", &v)
+		&& json_object_get_type(v) == json_type_int ? json_object_get_int(v) : 3600;
+	json_object_put(data);
+	return *bearer != NULL;
+}
+
+/* the thread renewing the tokens */
+static void *renewer(void *arg)
+{
+	struct token *t, *next;
+	struct timespec ts;
+	char *uid, *bearer;
+	int expires, ok;
+	time_t now;
+	unsigned i;
+
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		/* search the next token to renew */
+		now = time(NULL);
+		next = NULL;
+		for (i = 0 ; i <= mask ; i++) {
+			t = &table[i];
+			if (t->uid && now - t->used < RENEW_IDLE
+			 && (!next || t->renew < next->renew))
+				next = t;
+		}
+		if (!next || next->renew > now) {
+			ts.tv_sec = next ? next->renew : now + RENEW_IDLE;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&cond, &mutex, &ts);
+			continue;
+		}
+
+		/* renew it */
+		uid = strdup(next->uid);
+		next->renew = now + RETRY_DELAY;
+		if (!uid)
+			continue;
+		pthread_mutex_unlock(&mutex);
+		ok = fetch(uid, &bearer, &expires);
+		pthread_mutex_lock(&mutex);
+		if (ok) {
+			st.renewals++;
+			if (search(uid, hash_of(uid)))
+				store(uid, bearer, expires, time(NULL));
+			else
+				free(bearer);
+		} else
+			st.failures++;
+		free(uid);
+	}
+	return NULL;
+}
+
+/*
+ * Initializes the cache for at most 'maxcount' tokens and starts their
+ * renewal.
+ */
+int tokens_init(int max)
+{
+	pthread_t tid;
+	unsigned capacity;
+
+	maxcount = max > 0 ? (unsigned)max : 1;
+	/* keep the load under 1/2 */
+	for (capacity = 4 ; capacity < 2 * maxcount ; capacity <<= 1);
+	table = calloc(capacity, sizeof *table);
+	if (!table)
+		return -1;
+	mask = capacity - 1;
+	if (pthread_create(&tid, NULL, renewer, NULL))
+		return -1;
+	pthread_detach(tid);
+	return 0;
+}
+
+/*
+ * Returns a copy of the bearer of 'uid' that must be freed or NULL on
+ * error. The bearer is fetched when not already cached.
+ */
+char *tokens_get(const char *uid)
+{
+	struct token *t;
+	char *result, *bearer;
+	int expires;
+	time_t now;
+
+	if (!table)
+		return NULL;
+	now = time(NULL);
+	pthread_mutex_lock(&mutex);
+	t = search(uid, hash_of(uid));
+	if (t && t->expire > now) {
+		t->used = now;
+		st.hits++;
+		result = strdup(t->bearer);
+		pthread_mutex_unlock(&mutex);
+		return result;
+	}
+	st.misses++;
+	pthread_mutex_unlock(&mutex);
+
+	if (!fetch(uid, &bearer, &expires)) {
+		pthread_mutex_lock(&mutex);
+		st.failures++;
+		pthread_mutex_unlock(&mutex);
+		return NULL;
+	}
+	result = strdup(bearer);
+	pthread_mutex_lock(&mutex);
+	t = store(uid, bearer, expires, now);
+	if (t)
+		t->used = now;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+struct json_object *tokens_stats()
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	pthread_mutex_lock(&mutex);
+	json_object_object_add(result, "count", json_object_new_int64(count));
+	json_object_object_add(result, "max-count", json_object_new_int64(maxcount));
+	json_object_object_add(result, "capacity", json_object_new_int64(mask + 1));
+	json_object_object_add(result, "hits", json_object_new_int64(st.hits));
+	json_object_object_add(result, "misses", json_object_new_int64(st.misses));
+	json_object_object_add(result, "renewals", json_object_new_int64(st.renewals));
+	json_object_object_add(result, "failures", json_object_new_int64(st.failures));
+	json_object_object_add(result, "evictions", json_object_new_int64(st.evictions));
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */
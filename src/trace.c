@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Traces of the binding.
+ *
+ * The traces are gated by a level (syslog levels) checked before any
+ * formatting and rate limited per call site: over 'rate' traces per
+ * second, the traces of a site are suppressed and their count is
+ * reported by the next trace of that site. The traces are emitted and
+ * kept in a ring buffer written without lock, the entries being
+ * stamped with a sequence number that lets the reader skip those being
+ * overwritten.
+ */
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <json-c/json.h>
+
+#include "trace.h"
+
+/* count of entries of the ring, a power of 2 */
+#define RING_SIZE	256
+
+/* maximum length of the messages */
+#define MESSAGE_MAX	200
+
+/* an entry of the ring */
+struct entry {
+	unsigned long seq;		/* index + 1 or 0 while written */
+	struct timespec time;
+	const struct trace_site *site;
+	int level;
+	char message[MESSAGE_MAX];
+};
+
+int trace_level = 5;
+static unsigned rate = 10;
+static void (*emit)(int level, const char *func, int line, const char *message);
+
+static struct entry ring[RING_SIZE];
+static unsigned long head;
+static unsigned long suppressed;
+
+/*
+ * Sets the 'level' of the traces, the maximum 'rate' of the traces per
+ * second and per site (0 for no limit) and the function emitting them.
+ */
+void trace_init(int level, int r, void (*e)(int level, const char *func, int line, const char *message))
+{
+	trace_level = level;
+	rate = r > 0 ? (unsigned)r : 0;
+	emit = e;
+}
+
+void trace_set_level(int level)
+{
+	trace_level = level;
+}
+
+/* tells whether the trace of 'site' is within the rate */
+int trace_allow(struct trace_site *site)
+{
+	struct timespec ts;
+	long window;
+
+	if (!rate)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+	if (window != ts.tv_sec
+	 && __atomic_compare_exchange_n(&site->window, &window, ts.tv_sec,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) <= rate)
+		return 1;
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&suppressed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* records and emits the trace of 'site' */
+void trace_log(int level, struct trace_site *site, const char *fmt, ...)
+{
+	struct entry *e;
+	unsigned long idx;
+	unsigned count;
+	va_list ap;
+	int n;
+
+	idx = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	e = &ring[idx & (RING_SIZE - 1)];
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_REALTIME, &e->time);
+	e->site = site;
+	e->level = level;
+	va_start(ap, fmt);
+	n = vsnprintf(e->message, sizeof e->message, fmt, ap);
+	va_end(ap);
+	count = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+	if (count && n >= 0 && (size_t)n < sizeof e->message)
+		snprintf(&e->message[n], sizeof e->message - (size_t)n,
+			" [%u suppressed]", count);
+	if (emit)
+		emit(level, site->func, site->line, e->message);
+
+	__atomic_store_n(&e->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/* returns the state and the entries of the ring from the oldest */
+struct json_object *trace_dump()
+{
+	struct json_object *result, *entries, *item;
+	struct entry copy;
+	unsigned long idx, end, seq;
+	char site[100];
+
+	entries = json_object_new_array();
+	end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	for (idx = end > RING_SIZE ? end - RING_SIZE : 0 ; idx < end ; idx++) {
+		seq = __atomic_load_n(&ring[idx & (RING_SIZE - 1)].seq, __ATOMIC_ACQUIRE);
+		if (seq != idx + 1)
+			continue;
+		copy = ring[idx & (RING_SIZE - 1)];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ring[idx & (RING_SIZE - 1)].seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		copy.message[sizeof copy.message - 1] = 0;
+		snprintf(site, sizeof site, "%s:%d", copy.site->func, copy.site->line);
+		item = json_object_new_object();
+		json_object_object_add(item, "time", json_object_new_double(
+			(double)copy.time.tv_sec + copy.time.tv_nsec / 1e9));
+		json_object_object_add(item, "level", json_object_new_int(copy.level));
+		json_object_object_add(item, "site", json_object_new_string(site));
+		json_object_object_add(item, "message", json_object_new_string(copy.message));
+		json_object_array_add(entries, item);
+	}
+
+	result = json_object_new_object();
+	json_object_object_add(result, "level", json_object_new_int(trace_level));
+	json_object_object_add(result, "rate", json_object_new_int64(rate));
+	json_object_object_add(result, "logged", json_object_new_int64(end));
+	json_object_object_add(result, "suppressed", json_object_new_int64(
+		__atomic_load_n(&suppressed, __ATOMIC_RELAXED)));
+	json_object_object_add(result, "entries", entries);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */
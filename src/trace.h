@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+struct json_object;
+
+/* a call site of the traces, rate limited per second */
+struct trace_site {
+	const char *func;
+	int line;
+	long window;		/* second of the current window */
+	unsigned count;		/* count of traces in the window */
+	unsigned suppressed;	/* count of traces suppressed not reported */
+};
+
+extern int trace_level;
+
+extern void trace_init(int level, int rate, void (*emit)(int level, const char *func, int line, const char *message));
+extern void trace_set_level(int level);
+extern int trace_allow(struct trace_site *site);
+extern void trace_log(int level, struct trace_site *site, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+extern struct json_object *trace_dump();
+
+/*
+ * The arguments are evaluated and formatted only when the level is
+ * enabled and the rate of the call site not exceeded.
+ */
+#define TRACE(level,...) \
+	do { \
+		static struct trace_site _site = { __func__, __LINE__, 0, 0, 0 }; \
+		if ((level) <= trace_level && trace_allow(&_site)) \
+			trace_log((level), &_site, __VA_ARGS__); \
+	} while (0)
+
+#define TRACE_ERROR(...)	TRACE(3, __VA_ARGS__)
+#define TRACE_WARNING(...)	TRACE(4, __VA_ARGS__)
+#define TRACE_NOTICE(...)	TRACE(5, __VA_ARGS__)
+#define TRACE_INFO(...)		TRACE(6, __VA_ARGS__)
+#define TRACE_DEBUG(...)	TRACE(7, __VA_ARGS__)
+
+/* vim: set colorcolumn=80: */
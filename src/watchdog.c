@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2017 "IoT.bzh"
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Watchdog of the player.
+ *
+ * The standard error of the player is read by a thread that follows
+ * the milestones logged by librespot: authenticated, loading of a track
+ * and track loaded, the first audio. The times to the milestones are
+ * recorded in histograms. A player that isn't authenticated or doesn't
+ * load its track before the deadline is declared hung, as is a player
+ * that died without being stopped, and the binding is asked to restart
+ * it. The restarts are delayed by an exponential backoff and abandoned
+ * after too many consecutive failures, the count being cleared when a
+ * player authenticates.
+ */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <json-c/json.h>
+
+#include "trace.h"
+#include "pcm.h"
+#include "watchdog.h"
+
+/* milestones logged by librespot */
+static const char auth_pattern[] = "Authenticated as";
+static const char load_pattern[] = "Loading ";
+static const char play_pattern[] = " loaded";
+
+/* maximum length of the lines of the player */
+#define LINE_MAX	512
+
+/* period in ms of the liveness check after the close of its output */
+#define ALIVE_PERIOD	1000
+
+/* delay in ms before the first restart, doubled at each failure */
+#define BACKOFF_MIN	1000
+
+/* maximum delay in ms before a restart */
+#define BACKOFF_MAX	60000
+
+/* count of consecutive failures after which the restarts are abandoned */
+#define MAX_FAILURES	5
+
+/* upper bounds in ms of the buckets of the histograms */
+static const long bounds[] = { 250, 500, 1000, 2000, 5000, 10000, 30000 };
+#define NBOUNDS		(int)(sizeof bounds / sizeof *bounds)
+
+enum state { Stopped, Starting, Idle, Loading, Playing, Hung };
+static const char *const state_names[] = {
+	"stopped", "starting", "idle", "loading", "playing", "hung"
+};
+
+struct histogram {
+	unsigned counts[NBOUNDS + 1];	/* the last one for the overflow */
+	unsigned count;
+	long sum, min, max, last;
+};
+
+/* a supervised player */
+struct player {
+	int fd;			/* read end of its standard error */
+	int pid;
+	long started;		/* time in ms of its start */
+};
+
+static long deadline;
+static void (*onfailed)(int pid, int restart);
+static int wrfd = -1;
+static int rdfd = -1;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct {
+	int pid;		/* the current player or 0 */
+	enum state state;	/* state of the current player */
+	long started;		/* time in ms of the start of the player */
+	struct histogram auth;	/* times to the authentication */
+	struct histogram audio;	/* times from loading to the first audio */
+	unsigned starts;	/* count of players started */
+	unsigned exits;		/* count of players died unexpectedly */
+	unsigned hangs;		/* count of players declared hung */
+	unsigned failures;	/* count of consecutive failures */
+	int gaveup;		/* were the restarts abandoned? */
+} st;
+
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void record(struct histogram *h, long value)
+{
+	int i;
+
+	for (i = 0 ; i < NBOUNDS && value > bounds[i] ; i++);
+	h->counts[i]++;
+	if (!h->count || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->count++;
+	h->sum += value;
+	h->last = value;
+}
+
+/* tells whether the process 'pid' runs, a zombie doesn't */
+static int alive(int pid)
+{
+	char path[40], buffer[256], *p;
+	ssize_t rc;
+	int fd;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	rc = read(fd, buffer, sizeof buffer - 1);
+	close(fd);
+	if (rc <= 0)
+		return 0;
+	buffer[rc] = 0;
+	p = strrchr(buffer, ')');
+	return p && p[1] == ' ' && p[2] != 'Z' && p[2] != 'X';
+}
+
+/* sets the state of 'player' if it is the current one */
+static int set_state(struct player *player, enum state state)
+{
+	int current;
+
+	pthread_mutex_lock(&mutex);
+	current = st.pid == player->pid;
+	if (current)
+		st.state = state;
+	pthread_mutex_unlock(&mutex);
+	return current;
+}
+
+/*
+ * Declares 'player' hung or died and asks its restart after the backoff
+ * delay, or its stop when the failures are too many.
+ */
+static void failed(struct player *player, int hung)
+{
+	struct timespec ts;
+	long delay;
+	int current, restart;
+
+	restart = 0;
+	pthread_mutex_lock(&mutex);
+	current = st.pid == player->pid;
+	if (current) {
+		st.state = Hung;
+		if (hung)
+			st.hangs++;
+		else
+			st.exits++;
+		restart = ++st.failures <= MAX_FAILURES;
+		st.gaveup = !restart;
+		delay = BACKOFF_MIN << (st.failures - 1 < 6 ? st.failures - 1 : 6);
+		if (delay > BACKOFF_MAX)
+			delay = BACKOFF_MAX;
+
+		/* wait the backoff delay unless the player is stopped */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += delay / 1000;
+		ts.tv_nsec += (delay % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while (restart && st.pid == player->pid
+		    && pthread_cond_timedwait(&cond, &mutex, &ts) == 0);
+		current = st.pid == player->pid;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (current) {
+		if (restart)
+			TRACE_WARNING("player %d %s, restarting it", player->pid,
+				hung ? "hung" : "died");
+		else
+			TRACE_ERROR("player %d %s, %d failures, giving up",
+				player->pid, hung ? "hung" : "died", MAX_FAILURES);
+		if (onfailed)
+			onfailed(player->pid, restart);
+	}
+}
+
+/* processes the 'line' of 'player' in the 'state' since 'since' */
+static void process(struct player *player, char *line, enum state *state, long *since)
+{
+	long now;
+
+	/* the lines of the player are prefixed by their level */
+	if (!strncmp(line, "ERROR", 5) || strstr(line, "panicked"))
+		TRACE_ERROR("player: %s", line);
+	else if (!strncmp(line, "WARN", 4))
+		TRACE_WARNING("player: %s", line);
+	else
+		TRACE_INFO("player: %s", line);
+	now = now_ms();
+	if (*state == Starting && strstr(line, auth_pattern)) {
+		pthread_mutex_lock(&mutex);
+		record(&st.auth, now - *since);
+		if (st.pid == player->pid)
+			st.failures = 0;
+		pthread_mutex_unlock(&mutex);
+		*state = Idle;
+	} else if (*state != Starting && *state != Hung && strstr(line, load_pattern)) {
+		*state = Loading;
+		*since = now;
+		pcm_play();
+	} else if (*state == Loading && strstr(line, play_pattern)) {
+		pthread_mutex_lock(&mutex);
+		record(&st.audio, now - *since);
+		pthread_mutex_unlock(&mutex);
+		*state = Playing;
+	} else
+		return;
+	set_state(player, *state);
+}
+
+/* the thread following the player 'arg' */
+static void *follow(void *arg)
+{
+	struct player *player = arg;
+	struct pollfd pfd;
+	char line[LINE_MAX + 1], *eol;
+	enum state state;
+	size_t length;
+	long since, timeout;
+	ssize_t rc;
+
+	state = Starting;
+	since = player->started;
+	length = 0;
+	pfd.fd = player->fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		/* the deadline of the expected milestone */
+		timeout = -1;
+		if (deadline > 0 && (state == Starting || state == Loading)) {
+			timeout = since + deadline - now_ms();
+			if (timeout <= 0) {
+				state = Hung;
+				failed(player, 1);
+				continue;
+			}
+		}
+		rc = poll(&pfd, 1, (int)timeout);
+		if (rc < 0 && errno != EINTR)
+			break;
+		if (rc <= 0)
+			continue;
+
+		rc = read(player->fd, &line[length], LINE_MAX - length);
+		if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (rc <= 0)
+			break;
+		length += (size_t)rc;
+		line[length] = 0;
+		while ((eol = strchr(line, '\n')) || length == LINE_MAX) {
+			if (eol)
+				*eol++ = 0;
+			else
+				eol = &line[length];
+			process(player, line, &state, &since);
+			length -= (size_t)(eol - line);
+			memmove(line, eol, length + 1);
+		}
+	}
+
+	/* the output is closed, check the liveness */
+	close(player->fd);
+	while (state != Hung && alive(player->pid)) {
+		pthread_mutex_lock(&mutex);
+		rc = st.pid == player->pid;
+		pthread_mutex_unlock(&mutex);
+		if (!rc)
+			break;
+		usleep(ALIVE_PERIOD * 1000);
+	}
+	if (state != Hung)
+		failed(player, 0);
+	free(player);
+	return NULL;
+}
+
+/*
+ * Enables the watchdog with a 'deadline' in milliseconds (0 for none)
+ * for the milestones. The callback 'failed' receives the pid of a
+ * player hung or died and whether it has to be restarted or stopped.
+ */
+int watchdog_init(long dl, void (*failed)(int pid, int restart))
+{
+	deadline = dl;
+	onfailed = failed;
+	return 0;
+}
+
+/*
+ * Creates the pipe for the standard error of a player about to start.
+ * Returns the file descriptor that the player writes or -1 on error.
+ * Must be followed by a call to watchdog_started.
+ */
+int watchdog_open()
+{
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	rdfd = fds[0];
+	wrfd = fds[1];
+	return wrfd;
+}
+
+/*
+ * Tells that the player 'pid' started or not ('pid' null). When started,
+ * it is followed until it closes its standard error and stops.
+ */
+void watchdog_started(int pid)
+{
+	struct player *player;
+	pthread_t tid;
+
+	if (wrfd < 0)
+		return;
+	close(wrfd);
+	wrfd = -1;
+	player = pid ? malloc(sizeof *player) : NULL;
+	if (player) {
+		player->fd = rdfd;
+		player->pid = pid;
+		player->started = now_ms();
+		pthread_mutex_lock(&mutex);
+		st.pid = pid;
+		st.state = Starting;
+		st.started = player->started;
+		st.starts++;
+		pthread_mutex_unlock(&mutex);
+		if (!pthread_create(&tid, NULL, follow, player))
+			pthread_detach(tid);
+		else {
+			close(rdfd);
+			free(player);
+		}
+	} else
+		close(rdfd);
+	rdfd = -1;
+}
+
+/* tells that the current player is deliberately stopped */
+void watchdog_stop()
+{
+	pthread_mutex_lock(&mutex);
+	st.pid = 0;
+	st.state = Stopped;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+/* clears the failures, the player being started on purpose */
+void watchdog_reset()
+{
+	pthread_mutex_lock(&mutex);
+	st.failures = 0;
+	st.gaveup = 0;
+	pthread_mutex_unlock(&mutex);
+}
+
+static struct json_object *histogram_json(struct histogram *h)
+{
+	struct json_object *result, *b, *c;
+	int i;
+
+	b = json_object_new_array();
+	c = json_object_new_array();
+	for (i = 0 ; i <= NBOUNDS ; i++) {
+		if (i < NBOUNDS)
+			json_object_array_add(b, json_object_new_int64(bounds[i]));
+		json_object_array_add(c, json_object_new_int64(h->counts[i]));
+	}
+	result = json_object_new_object();
+	json_object_object_add(result, "count", json_object_new_int64(h->count));
+	json_object_object_add(result, "last", json_object_new_int64(h->last));
+	json_object_object_add(result, "min", json_object_new_int64(h->min));
+	json_object_object_add(result, "max", json_object_new_int64(h->max));
+	json_object_object_add(result, "mean", json_object_new_int64(h->count ? h->sum / h->count : 0));
+	json_object_object_add(result, "bounds", b);
+	json_object_object_add(result, "counts", c);
+	return result;
+}
+
+struct json_object *watchdog_stats()
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	pthread_mutex_lock(&mutex);
+	json_object_object_add(result, "state", json_object_new_string(state_names[st.state]));
+	json_object_object_add(result, "pid", json_object_new_int(st.pid));
+	json_object_object_add(result, "deadline", json_object_new_int64(deadline));
+	json_object_object_add(result, "starts", json_object_new_int64(st.starts));
+	json_object_object_add(result, "exits", json_object_new_int64(st.exits));
+	json_object_object_add(result, "hangs", json_object_new_int64(st.hangs));
+	json_object_object_add(result, "failures", json_object_new_int64(st.failures));
+	json_object_object_add(result, "gave-up", json_object_new_boolean(st.gaveup));
+	json_object_object_add(result, "time-to-authenticated", histogram_json(&st.auth));
+	json_object_object_add(result, "time-to-first-audio", histogram_json(&st.audio));
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+/* vim: set colorcolumn=80: */